@@ -1,17 +1,34 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/fs.h>	
+#include <linux/percpu.h>
+#include <linux/kobject.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("Registers a device number and implements some callback functions");
 
+/**
+ * Per-CPU counters, shown as totals in /sys/kernel/dev_nr/stats/
+ */
+struct driver_stats {
+   u64 opens;
+   u64 closes;
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
 /**
  * @brief function called when the device file is opened
  */
 static int driver_open(struct inode * device_file, struct file * instance) 
 {
    printk("dev_nr - open was called!\n");
+   STAT_INC(opens);
    return 0;
 }
 
@@ -21,6 +38,7 @@ static int driver_open(struct inode * device_file, struct file * instance)
 static int driver_close(struct inode * device_file, struct file * instance) 
 {
    printk("dev_nr - close was called!\n");
+   STAT_INC(closes);
    return 0;
 }
 
@@ -32,6 +50,40 @@ static struct file_operations fops = {
 
 #define MY_MAJOR 91     // Free device number. Check list in cat /proc/devices
 
+/**
+ * @brief Add up the per-CPU copies of a counter
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(opens);
+STATS_ATTR(closes);
+
+static struct attribute * stats_attrs[] = {
+   &opens_attr.attr,
+   &closes_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
 
 /**
  * @brief function called when the module is loaded into the kernel
@@ -66,6 +118,16 @@ static int __init myInit(void)
       printk("dev_nr - Could not register device number!\n");
       return -1;
    }
+
+   // Create /sys/kernel/dev_nr/stats
+   stats_kobj = kobject_create_and_add("dev_nr", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("dev_nr - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      unregister_chrdev(MY_MAJOR, "my_dev_nr");
+      return -ENOMEM;
+   }
    return 0;
 }
 
@@ -75,6 +137,7 @@ static int __init myInit(void)
 static void __exit myExit(void)
 {
    // Unregister our device
+   kobject_put(stats_kobj);
    unregister_chrdev(MY_MAJOR, "my_dev_nr");
    printk("dev_nr - Nos vamos!\n");
    return;
@@ -3,61 +3,466 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/ioctl.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+
+#include "ring_shared.h"
+#include "../18_Procfs/latency_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "read_write_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("Registers a device number and implements some callback functions");
 
-// Buffer for data
-static char buffer[255];
-static int buffer_pointer = 0;
+// Size of the ring buffer in bytes. It must be a power of two, so that
+// indexes can be wrapped with a mask instead of a modulo operation
+static unsigned int buffer_size = 1 << 20;
+module_param(buffer_size, uint, S_IRUGO);
+MODULE_PARM_DESC(buffer_size, "Size of the ring buffer in bytes (power of two, 1 MiB - 64 MiB)");
+
+// Amount of device files (minors) to create, each one with its own ring
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of independent devices to create (1 - 256)");
+
+#define RING_MIN_SIZE (1 << 20)
+#define RING_MAX_SIZE (64 << 20)
+#define MAX_DEVICES 256
+
+/**
+ * Single producer / single consumer ring buffer for data.
+ *
+ * head is only written by the producer (do_write_iter) and tail only by the
+ * consumer (do_read_iter). Both indexes live in a control page that can be
+ * mapped by user space together with the data (see ring_shared.h), each one
+ * in its own cache line, so a writer and a reader running on different cores
+ * do not bounce the same line.
+ * Indexes run freely and are masked on access: head - tail is the fill level.
+ */
+struct ring_buffer {
+   struct ring_ctrl * ctrl;                     // Control page, start of the mapping
+   char * data;                                 // Data, right after the control page
+   u32 mask;                                    // Size - 1
+
+   // Producer side
+   struct mutex write_lock ____cacheline_aligned_in_smp;   // Serializes writers among themselves
+   wait_queue_head_t write_wait;                // Writers waiting for free space
+
+   // Consumer side
+   struct mutex read_lock ____cacheline_aligned_in_smp;    // Serializes readers among themselves
+   wait_queue_head_t read_wait;                 // Readers waiting for data
+};
+
+/**
+ * State of every device file (minor). Nothing is shared between them,
+ * so independent streams don't contend with each other.
+ */
+struct driver_data {
+   struct cdev cdev;                            // The device object
+   unsigned int minor;
+   struct mutex open_lock;                      // Protects the allocation of the ring
+   struct ring_buffer ring;
+};
+
+/**
+ * Statistics of the module. Every CPU updates its own copy without atomics
+ * or shared cache lines, and they are summed up when read from sysfs
+ * (/sys/kernel/read_write/stats/)
+ */
+struct driver_stats {
+   u64 reads;
+   u64 writes;
+   u64 bytes_read;
+   u64 bytes_written;
+   u64 ioctls;
+   u64 wakeups;         // Wake ups issued to sleeping readers or writers
+   u64 would_block;     // Calls that returned -EAGAIN
+   u64 errors;          // Calls that failed for any other reason
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Latency of every file operation, shown in /proc/hello/latency
+// when the procfs module (exercise 18) is loaded
+static struct latency_hist read_hist;
+static struct latency_hist write_hist;
+static struct latency_hist ioctl_hist;
 
 // Variables for device and device class
-static dev_t my_device_nr;       // The device number assigned by the kernel
+static dev_t my_device_nr;       // The device number assigned by the kernel (first minor)
 static struct class *my_class;   // Pointer to the driver class 
-static struct cdev my_device;    // The device object
+static struct driver_data * my_devices;   // One per minor
 
 #define DRIVER_NAME "dummydriver"
 #define DRIVER_CLASS "MyModuleClass"
 
 /**
- * @brief Read data out of the buffer
+ * @brief Allocate the control page and the data of a ring
+ */
+static int ring_alloc(struct ring_buffer * ring)
+{
+   // vmalloc_user() returns zeroed memory that can be mapped into user space.
+   // The control page comes first and the data right after it.
+   ring->ctrl = vmalloc_user(PAGE_SIZE + buffer_size);
+   if(ring->ctrl == NULL)
+      return -ENOMEM;
+
+   ring->data = (char *) ring->ctrl + PAGE_SIZE;
+   ring->mask = buffer_size - 1;
+   ring->ctrl->size = buffer_size;
+   ring->ctrl->data_offset = PAGE_SIZE;
+   return 0;
+}
+
+/**
+ * @brief Copy len bytes starting at index tail from the ring to the iterator,
+ * which may describe several user buffers (readv). Returns the amount of
+ * bytes actually copied
+ */
+static size_t ring_copy_to_iter(struct ring_buffer * ring, struct iov_iter * to, u32 tail, size_t len)
+{
+   size_t pos = tail & ring->mask;
+   size_t first = min_t(size_t, len, ring->mask + 1 - pos);
+   size_t copied;
+
+   // The data may wrap around the end of the buffer: copy it in two chunks
+   copied = copy_to_iter(ring->data + pos, first, to);
+   if(copied < first)
+      return copied;
+
+   return copied + copy_to_iter(ring->data, len - first, to);
+}
+
+/**
+ * @brief Copy len bytes from the iterator into the ring, starting at index head.
+ * Returns the amount of bytes actually copied
+ */
+static size_t ring_copy_from_iter(struct ring_buffer * ring, struct iov_iter * from, u32 head, size_t len)
+{
+   size_t pos = head & ring->mask;
+   size_t first = min_t(size_t, len, ring->mask + 1 - pos);
+   size_t copied;
+
+   copied = copy_from_iter(ring->data + pos, first, from);
+   if(copied < first)
+      return copied;
+
+   return copied + copy_from_iter(ring->data, len - first, from);
+}
+
+/**
+ * @brief Whether the caller must not sleep: O_NONBLOCK file or
+ * a non-blocking attempt from io_uring / preadv2(RWF_NOWAIT)
+ */
+static inline bool must_not_wait(struct kiocb * iocb)
+{
+   return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/**
+ * @brief Take the mutex of one side of the ring, without sleeping if nowait
  */
-static ssize_t driver_read(struct file * File, char * user_buffer, size_t count, loff_t * offset)
+static inline int ring_lock(struct mutex * lock, bool nowait)
 {
-   int to_copy, not_copied, delta;
+   if(nowait)
+      return mutex_trylock(lock) ? 0 : -EAGAIN;
+   return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
 
-   // 1. Get the amount of data to copy, which will be the minimum
+/**
+ * @brief Amount of bytes stored between tail and head. The indexes may
+ * be written from user space, so never trust them beyond the ring size
+ */
+static inline u32 ring_used(struct ring_buffer * ring, u32 head, u32 tail)
+{
+   return min_t(u32, head - tail, ring->mask + 1);
+}
+
+/**
+ * @brief Read data out of the buffer. Sleeps until some data is available,
+ * unless the file was opened with O_NONBLOCK.
+ * Used by read() and readv(): the whole scatter-gather list is filled
+ * in one call and one copy pass.
+ */
+static ssize_t do_read_iter(struct kiocb * iocb, struct iov_iter * to)
+{
+   struct driver_data * dev = iocb->ki_filp->private_data;
+   struct ring_buffer * ring = &dev->ring;
+   bool nowait = must_not_wait(iocb);
+   size_t count = iov_iter_count(to);
+   u32 head, tail;
+   size_t to_copy, copied;
+   int ret;
+
+   if(count == 0)
+      return 0;
+
+   if((ret = ring_lock(&ring->read_lock, nowait)))
+      return ret;
+
+   // 1. Wait for data. The acquire pairs with the release in
+   // do_write_iter: the bytes are visible before the new head is.
+   tail = ring->ctrl->tail;
+   while((head = smp_load_acquire(&ring->ctrl->head)) == tail)
+   {
+      mutex_unlock(&ring->read_lock);
+
+      if(nowait)
+         return -EAGAIN;
+
+      if(wait_event_interruptible(ring->read_wait, smp_load_acquire(&ring->ctrl->head) != tail))
+         return -ERESTARTSYS;
+
+      if((ret = ring_lock(&ring->read_lock, false)))
+         return ret;
+      tail = ring->ctrl->tail;
+   }
+
+   // 2. Get the amount of data to copy, which will be the minimum
    // between the amount of bytes requested and the amount of bytes
-   // stored in the buffer (indicated by the pointer value)
-   to_copy = min(count, buffer_pointer);
+   // stored in the ring.
+   to_copy = min_t(size_t, count, ring_used(ring, head, tail));
+
+   // 3. Copy the data to the user
+   copied = ring_copy_to_iter(ring, to, tail, to_copy);
+
+   // 4. Hand the consumed space back to the producer. The release
+   // makes sure we are done reading before it can be overwritten.
+   smp_store_release(&ring->ctrl->tail, tail + copied);
+   iocb->ki_pos += copied;
 
-   // 2. Copy the data to the user
-   not_copied = copy_to_user(user_buffer, buffer, to_copy);
+   mutex_unlock(&ring->read_lock);
 
-   // 3. Calculate how much data it has copied
-   delta = to_copy - not_copied;
-   return delta;
+   // 5. Wake up writers waiting for space. wq_has_sleeper() keeps
+   // the common case (nobody waiting) free of the wait queue lock.
+   if(copied && wq_has_sleeper(&ring->write_wait))
+   {
+      wake_up_interruptible(&ring->write_wait);
+      STAT_INC(wakeups);
+   }
+
+   if(!copied)
+      return -EFAULT;
+   return copied;
 }
 
 /**
- * @brief Write data to buffer
+ * @brief Write data to buffer. Sleeps until some space is free,
+ * unless the file was opened with O_NONBLOCK.
+ * Used by write() and writev(): a header and a payload in different
+ * buffers are stored with a single call.
  */
-static ssize_t driver_write(struct file * File, const char * user_buffer, size_t count, loff_t * offset)
+static ssize_t do_write_iter(struct kiocb * iocb, struct iov_iter * from)
 {
-   int to_copy, not_copied;
+   struct driver_data * dev = iocb->ki_filp->private_data;
+   struct ring_buffer * ring = &dev->ring;
+   bool nowait = must_not_wait(iocb);
+   size_t count = iov_iter_count(from);
+   u32 head, tail;
+   size_t to_copy, copied;
+   int ret;
+
+   if(count == 0)
+      return 0;
+
+   if((ret = ring_lock(&ring->write_lock, nowait)))
+      return ret;
+
+   // 1. Wait for free space. The acquire pairs with the release
+   // in do_read_iter.
+   head = ring->ctrl->head;
+   while(ring_used(ring, head, tail = smp_load_acquire(&ring->ctrl->tail)) > ring->mask)
+   {
+      mutex_unlock(&ring->write_lock);
 
-   // 1. Get the amount of data to copy, which will be the minimum
-   // between the amount of bytes requested and the size of the buffer
-   to_copy = min(count, sizeof(buffer));
+      if(nowait)
+         return -EAGAIN;
 
-   // 2. Copy the data to the user
-   not_copied = copy_from_user(buffer, user_buffer, to_copy);
-   
-   // 3. Update the pointer, whose value also indicates how much
-   // data has been written
-   buffer_pointer = to_copy - not_copied;
-   return buffer_pointer;
+      if(wait_event_interruptible(ring->write_wait, ring_used(ring, head, smp_load_acquire(&ring->ctrl->tail)) <= ring->mask))
+         return -ERESTARTSYS;
+
+      if((ret = ring_lock(&ring->write_lock, false)))
+         return ret;
+      head = ring->ctrl->head;
+   }
+
+   // 2. Get the amount of data to copy, which will be the minimum
+   // between the amount of bytes requested and the free space.
+   to_copy = min_t(size_t, count, ring->mask + 1 - ring_used(ring, head, tail));
+
+   // 3. Copy the data from the user
+   copied = ring_copy_from_iter(ring, from, head, to_copy);
+
+   // 4. Publish the new bytes to the consumer
+   smp_store_release(&ring->ctrl->head, head + copied);
+   iocb->ki_pos += copied;
+
+   mutex_unlock(&ring->write_lock);
+
+   // 5. Wake up readers waiting for data
+   if(copied && wq_has_sleeper(&ring->read_wait))
+   {
+      wake_up_interruptible(&ring->read_wait);
+      STAT_INC(wakeups);
+   }
+
+   if(!copied)
+      return -EFAULT;
+   return copied;
+}
+
+/**
+ * @brief Account the result of a read or a write in the statistics
+ */
+static inline void count_result(ssize_t ret)
+{
+   if(ret == -EAGAIN)
+      STAT_INC(would_block);
+   else if(ret < 0)
+      STAT_INC(errors);
+}
+
+/**
+ * @brief read_iter callback. Its latency goes to the histogram and,
+ * when enabled, to the tracepoint
+ */
+static ssize_t driver_read_iter(struct kiocb * iocb, struct iov_iter * to)
+{
+   struct driver_data * dev = iocb->ki_filp->private_data;
+   size_t count = iov_iter_count(to);
+   u64 start = ktime_get_ns();
+   ssize_t ret = do_read_iter(iocb, to);
+   u64 latency = ktime_get_ns() - start;
+
+   latency_hist_record(&read_hist, latency);
+   trace_read_write_read(dev->minor, count, ret, latency);
+
+   STAT_INC(reads);
+   if(ret > 0)
+      STAT_ADD(bytes_read, ret);
+   else
+      count_result(ret);
+   return ret;
+}
+
+/**
+ * @brief write_iter callback, measured as driver_read_iter
+ */
+static ssize_t driver_write_iter(struct kiocb * iocb, struct iov_iter * from)
+{
+   struct driver_data * dev = iocb->ki_filp->private_data;
+   size_t count = iov_iter_count(from);
+   u64 start = ktime_get_ns();
+   ssize_t ret = do_write_iter(iocb, from);
+   u64 latency = ktime_get_ns() - start;
+
+   latency_hist_record(&write_hist, latency);
+   trace_read_write_write(dev->minor, count, ret, latency);
+
+   STAT_INC(writes);
+   if(ret > 0)
+      STAT_ADD(bytes_written, ret);
+   else
+      count_result(ret);
+   return ret;
+}
+
+/**
+ * @brief Poll callback: the device is readable while the ring holds data
+ * and writable while it has free space
+ */
+static unsigned int driver_poll(struct file * File, poll_table * wait)
+{
+   struct driver_data * dev = File->private_data;
+   struct ring_buffer * ring = &dev->ring;
+   unsigned int mask = 0;
+   u32 head, tail, used;
+
+   poll_wait(File, &ring->read_wait, wait);
+   poll_wait(File, &ring->write_wait, wait);
+
+   // Load tail first: head only grows, so head - tail can't underflow
+   tail = smp_load_acquire(&ring->ctrl->tail);
+   head = smp_load_acquire(&ring->ctrl->head);
+   used = ring_used(ring, head, tail);
+   if(used > 0)
+      mask |= POLLIN | POLLRDNORM;
+   if(used <= ring->mask)
+      mask |= POLLOUT | POLLWRNORM;
+
+   return mask;
+}
+
+/**
+ * @brief Map the control page and the ring data into user space, so that
+ * payloads can be read and written in place, without any copy
+ */
+static int driver_mmap(struct file * File, struct vm_area_struct * vma)
+{
+   struct driver_data * dev = File->private_data;
+
+   // Fails if the requested area goes beyond the end of the ring
+   return remap_vmalloc_range(vma, dev->ring.ctrl, vma->vm_pgoff);
+}
+
+/**
+ * @brief ioctl callback. RING_NOTIFY is issued by user space after moving
+ * head or tail through the mapping, to wake up whoever waits for it
+ */
+static long int driver_ioctl(struct file * File, unsigned cmd, unsigned long arg)
+{
+   struct driver_data * dev = File->private_data;
+   struct ring_buffer * ring = &dev->ring;
+   u64 start = ktime_get_ns();
+   u64 latency;
+   long int ret;
+
+   switch(cmd)
+   {
+      case RING_NOTIFY:
+         if(wq_has_sleeper(&ring->read_wait))
+         {
+            wake_up_interruptible(&ring->read_wait);
+            STAT_INC(wakeups);
+         }
+         if(wq_has_sleeper(&ring->write_wait))
+         {
+            wake_up_interruptible(&ring->write_wait);
+            STAT_INC(wakeups);
+         }
+         ret = 0;
+         break;
+
+      default:
+         ret = -ENOTTY;
+         STAT_INC(errors);
+         break;
+   }
+
+   latency = ktime_get_ns() - start;
+   latency_hist_record(&ioctl_hist, latency);
+   STAT_INC(ioctls);
+
+   trace_read_write_ioctl(dev->minor, cmd, ret, latency);
+   return ret;
 }
 
 /**
@@ -65,8 +470,32 @@ static ssize_t driver_write(struct file * File, const char * user_buffer, size_t
  */
 static int driver_open(struct inode * device_file, struct file * instance) 
 {
-   printk("read_write - open was called!\n");
-   return 0;
+   // Every minor has its own cdev, embedded in its driver_data
+   struct driver_data * dev = container_of(device_file->i_cdev, struct driver_data, cdev);
+
+   trace_read_write_open(dev->minor);
+
+   // The ring is allocated on the first open, so that unused minors
+   // don't hold any memory. It is kept until the module is unloaded,
+   // as the data must survive between a writer and a reader.
+   mutex_lock(&dev->open_lock);
+   if(dev->ring.ctrl == NULL && ring_alloc(&dev->ring))
+   {
+      mutex_unlock(&dev->open_lock);
+      printk("read_write - Ring buffer could not be allocated!\n");
+      return -ENOMEM;
+   }
+   mutex_unlock(&dev->open_lock);
+
+   // From now on, the callbacks find their device here
+   instance->private_data = dev;
+
+   // io_uring may try the read/write first without blocking (IOCB_NOWAIT),
+   // and only fall back to poll if the ring is empty/full
+   instance->f_mode |= FMODE_NOWAIT;
+
+   // The device is a stream: there is no position to seek to
+   return nonseekable_open(device_file, instance);
 }
 
 /**
@@ -74,7 +503,9 @@ static int driver_open(struct inode * device_file, struct file * instance)
  */
 static int driver_close(struct inode * device_file, struct file * instance) 
 {
-   printk("read_write - close was called!\n");
+   struct driver_data * dev = instance->private_data;
+
+   trace_read_write_release(dev->minor);
    return 0;
 }
 
@@ -82,33 +513,131 @@ static struct file_operations fops = {
    .owner = THIS_MODULE,
    .open = driver_open,
    .release = driver_close,
-   .read = driver_read,
-   .write = driver_write
+   .read_iter = driver_read_iter,     // Also used by read()
+   .write_iter = driver_write_iter,   // Also used by write()
+   .poll = driver_poll,
+   .mmap = driver_mmap,
+   .unlocked_ioctl = driver_ioctl
 };
 
 #define MY_MAJOR 91     // Free device number. Check list in cat /proc/devices
 
 
+/**
+ * @brief Sum up the counter at the given offset of driver_stats from all CPUs
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+// Show callback and kobj_attribute of every counter: /sys/kernel/read_write/stats/<field>
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(reads);
+STATS_ATTR(writes);
+STATS_ATTR(bytes_read);
+STATS_ATTR(bytes_written);
+STATS_ATTR(ioctls);
+STATS_ATTR(wakeups);
+STATS_ATTR(would_block);
+STATS_ATTR(errors);
+
+static struct attribute * stats_attrs[] = {
+   &reads_attr.attr,
+   &writes_attr.attr,
+   &bytes_read_attr.attr,
+   &bytes_written_attr.attr,
+   &ioctls_attr.attr,
+   &wakeups_attr.attr,
+   &would_block_attr.attr,
+   &errors_attr.attr,
+   NULL
+};
+
+// The group name makes sysfs create the "stats" folder for the attributes
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
+
+/**
+ * @brief Remove the first n device files and free their rings
+ */
+static void destroy_devices(unsigned int n)
+{
+   unsigned int i;
+
+   for(i = 0; i < n; i++)
+   {
+      cdev_del(&my_devices[i].cdev);
+      device_destroy(my_class, my_device_nr + i);
+      vfree(my_devices[i].ring.ctrl);
+   }
+}
+
 /**
  * @brief function called when the module is loaded into the kernel
  */
 
 static int __init myInit(void)
 {
+   unsigned int i;
+
    printk("read_write - Hello mundo!\n");
 
-   // 1. Allocate a device nr.
-   // The function will write the major and minor numbers in my_device_nr.
+   // 0. Check the parameters and allocate the state of every device.
+   // The rings themselves are allocated when each device is opened.
+   if(!is_power_of_2(buffer_size) || buffer_size < RING_MIN_SIZE || buffer_size > RING_MAX_SIZE)
+   {
+      printk("read_write - Invalid buffer_size %u\n", buffer_size);
+      return -EINVAL;
+   }
+
+   if(nr_devices == 0 || nr_devices > MAX_DEVICES)
+   {
+      printk("read_write - Invalid nr_devices %u\n", nr_devices);
+      return -EINVAL;
+   }
+
+   my_devices = kcalloc(nr_devices, sizeof(*my_devices), GFP_KERNEL);
+   if(my_devices == NULL)
+   {
+      printk("read_write - Device state could not be allocated!\n");
+      return -ENOMEM;
+   }
+
+   if(latency_hist_init(&read_hist, "read_write_read") ||
+      latency_hist_init(&write_hist, "read_write_write") ||
+      latency_hist_init(&ioctl_hist, "read_write_ioctl"))
+   {
+      printk("read_write - Latency histograms could not be allocated!\n");
+      goto RegionError;
+   }
+
+   // 1. Allocate a range of device numbers, one minor per device.
+   // The function will write the major and first minor numbers in my_device_nr.
    
-   if (alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0)
+   if (alloc_chrdev_region(&my_device_nr, 0, nr_devices, DRIVER_NAME) < 0)
    {
       printk("Device Nr. could not be allocated!\n");
-      return -1;
+      goto RegionError;
    }
 
    int major = my_device_nr >> 20;
    int minor = my_device_nr & 0xFFFFF;
-   printk("read_write - Device Nr. Major: %d, Minor: %d, was registered\n", major, minor);
+   printk("read_write - Device Nr. Major: %d, Minors: %d-%d, were registered\n", major, minor, minor + nr_devices - 1);
    
    // 2. Create device class
    if((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL)
@@ -117,23 +646,55 @@ static int __init myInit(void)
       goto ClassError;
    }
 
-   // 3. Create device file
-   if(device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL)
+   for(i = 0; i < nr_devices; i++)
    {
-      printk("Can not create device file\n");
-      goto FileError;
+      struct driver_data * dev = &my_devices[i];
+
+      dev->minor = MINOR(my_device_nr) + i;
+      mutex_init(&dev->open_lock);
+      mutex_init(&dev->ring.read_lock);
+      mutex_init(&dev->ring.write_lock);
+      init_waitqueue_head(&dev->ring.read_wait);
+      init_waitqueue_head(&dev->ring.write_wait);
+
+      // 3. Create device file: /dev/dummydriver0, /dev/dummydriver1...
+      if(device_create(my_class, NULL, my_device_nr + i, NULL, DRIVER_NAME "%u", i) == NULL)
+      {
+         printk("Can not create device file\n");
+         goto FileError;
+      }
+
+      // 4. Initialize device file
+      cdev_init(&dev->cdev, &fops);
+
+      // 5. Add the device file
+      if(cdev_add(&dev->cdev, my_device_nr + i, 1) == -1)
+      {
+         printk("Registering of device to kernel failed!\n");
+         goto AddError;
+      }
    }
 
-   // 4. Initialize device file
-   cdev_init(&my_device, &fops);
+   // 6. Create /sys/kernel/read_write/stats
+   stats_kobj = kobject_create_and_add("read_write", kernel_kobj);
+   if(stats_kobj == NULL)
+   {
+      printk("read_write - Error creating the sysfs folder\n");
+      goto FileError;
+   }
 
-   // 5. Add the device file
-   if(cdev_add(&my_device, my_device_nr, 1) == -1)
+   if(sysfs_create_group(stats_kobj, &stats_group))
    {
-      printk("Registering of device to kernel failed!\n");
-      goto AddError;
+      printk("read_write - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      goto FileError;
    }
 
+   // 7. Show the latencies in /proc/hello/latency, if the procfs module is loaded
+   latency_hist_publish(&read_hist);
+   latency_hist_publish(&write_hist);
+   latency_hist_publish(&ioctl_hist);
+
    return 0;
 
    // Error cases are managed with "goto" instructions so
@@ -141,11 +702,17 @@ static int __init myInit(void)
    // moment of the error 
 
 AddError:
-   device_destroy(my_class, my_device_nr);
+   device_destroy(my_class, my_device_nr + i);
 FileError:
+   destroy_devices(i);
    class_destroy(my_class);
 ClassError:
-   unregister_chrdev_region(my_device_nr, 1);
+   unregister_chrdev_region(my_device_nr, nr_devices);
+RegionError:
+   latency_hist_free(&ioctl_hist);
+   latency_hist_free(&write_hist);
+   latency_hist_free(&read_hist);
+   kfree(my_devices);
    return -1;
 
 }
@@ -156,18 +723,20 @@ ClassError:
 static void __exit myExit(void)
 {
    // Undo the steps done in myInit, in reverse order:
-   cdev_del(&my_device);
-   device_destroy(my_class, my_device_nr);
+   latency_hist_unpublish(&ioctl_hist);
+   latency_hist_unpublish(&write_hist);
+   latency_hist_unpublish(&read_hist);
+   kobject_put(stats_kobj);      // Also removes the stats group
+   destroy_devices(nr_devices);
    class_destroy(my_class);
-   unregister_chrdev_region(my_device_nr, 1);
+   unregister_chrdev_region(my_device_nr, nr_devices);
+   latency_hist_free(&ioctl_hist);
+   latency_hist_free(&write_hist);
+   latency_hist_free(&read_hist);
+   kfree(my_devices);
    printk("read_write - bye bye!\n");
    return;
 }
 
 module_init(myInit);
 module_exit(myExit);
-
-
-
-
-
@@ -0,0 +1,89 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM read_write
+
+#if !defined(_READ_WRITE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _READ_WRITE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Events without any cost while disabled. Enable them with:
+// echo 1 > /sys/kernel/tracing/events/read_write/enable
+
+DECLARE_EVENT_CLASS(read_write_file,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+   ),
+   TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(read_write_file, read_write_open,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor)
+);
+
+DEFINE_EVENT(read_write_file, read_write_release,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor)
+);
+
+DECLARE_EVENT_CLASS(read_write_io,
+   TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 latency_ns),
+   TP_ARGS(minor, count, ret, latency_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+      __field(size_t, count)
+      __field(ssize_t, ret)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->count = count;
+      __entry->ret = ret;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("minor=%u count=%zu ret=%zd latency_ns=%llu",
+      __entry->minor, __entry->count, __entry->ret, __entry->latency_ns)
+);
+
+DEFINE_EVENT(read_write_io, read_write_read,
+   TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 latency_ns),
+   TP_ARGS(minor, count, ret, latency_ns)
+);
+
+DEFINE_EVENT(read_write_io, read_write_write,
+   TP_PROTO(unsigned int minor, size_t count, ssize_t ret, u64 latency_ns),
+   TP_ARGS(minor, count, ret, latency_ns)
+);
+
+TRACE_EVENT(read_write_ioctl,
+   TP_PROTO(unsigned int minor, unsigned int cmd, long ret, u64 latency_ns),
+   TP_ARGS(minor, cmd, ret, latency_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+      __field(unsigned int, cmd)
+      __field(long, ret)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->cmd = cmd;
+      __entry->ret = ret;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("minor=%u cmd=0x%x ret=%ld latency_ns=%llu",
+      __entry->minor, __entry->cmd, __entry->ret, __entry->latency_ns)
+);
+
+#endif
+
+// The header is looked up in the module directory (see Makefile)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE read_write_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,26 @@
+#ifndef RING_SHARED_H
+#define RING_SHARED_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Layout of the area mapped with mmap() on /dev/dummydriver:
+// - Offset 0: control page, holding a struct ring_ctrl
+// - Offset data_offset: the ring data, size bytes long
+struct ring_ctrl
+{
+    __u32 size;             // Size of the ring data in bytes (power of two)
+    __u32 data_offset;      // Offset of the ring data inside the mapping
+
+    // Indexes run freely: position in the data is index & (size - 1)
+    // and head - tail is the amount of bytes stored
+    __u32 head __attribute__((aligned(64)));    // Producer index
+    __u32 tail __attribute__((aligned(64)));    // Consumer index
+};
+
+// The kernel will generate a unique magic number for the command.
+// Issued after moving head or tail from user space, to wake up
+// the readers or writers waiting in the driver.
+#define RING_NOTIFY _IO('d', 'n')
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+
+#include "ring_shared.h"
+
+#define DEVICE_FILE_NAME "/dev/dummydriver0"
+
+// Consumer that reads the ring in place through mmap():
+// no copy_to_user, and only a poll() when the ring is empty
+int main()
+{
+    struct ring_ctrl * ctrl;
+    struct pollfd my_poll = {0};
+    size_t map_size, total = 0;
+    char * data;
+    __u32 head, tail, mask;
+
+    int fd = open(DEVICE_FILE_NAME, O_RDWR);
+    if (fd == -1)
+    {
+        perror("Opening was not possible");
+        return -1;
+    }
+
+    // Map the control page first, to learn the size of the ring
+    ctrl = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+    if (ctrl == MAP_FAILED)
+    {
+        perror("Mapping the control page was not possible");
+        close(fd);
+        return -1;
+    }
+    map_size = ctrl->data_offset + ctrl->size;
+    munmap(ctrl, getpagesize());
+
+    // Now map the control page and the data
+    ctrl = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ctrl == MAP_FAILED)
+    {
+        perror("Mapping the ring was not possible");
+        close(fd);
+        return -1;
+    }
+    data = (char *) ctrl + ctrl->data_offset;
+    mask = ctrl->size - 1;
+
+    my_poll.fd = fd;
+    my_poll.events = POLLIN;
+
+    printf("Consuming from %s (%u bytes ring)...\n", DEVICE_FILE_NAME, ctrl->size);
+
+    while (1)
+    {
+        tail = ctrl->tail;
+        head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            // Empty ring: sleep in the driver until a producer writes
+            if (poll(&my_poll, 1, -1) < 0)
+            {
+                perror("Polling failed");
+                break;
+            }
+            continue;
+        }
+
+        // Consume the data in place. Here we just print the first byte
+        // of each chunk and count the bytes
+        printf("Got %u bytes, first one: '%c'\n", head - tail, data[tail & mask]);
+        total += head - tail;
+
+        // Give the space back and wake up any writer waiting for it
+        __atomic_store_n(&ctrl->tail, head, __ATOMIC_RELEASE);
+        ioctl(fd, RING_NOTIFY, NULL);
+    }
+
+    printf("Consumed %zu bytes\n", total);
+
+    munmap(ctrl, map_size);
+    close(fd);
+    return 0;
+}
@@ -4,55 +4,477 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/interrupt.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/device.h>
+
+#include "my_gpio.h"
+#include "../18_Procfs/latency_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "gpio_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("A simple gpio driver");
 
+#define DRIVER_NAME "my_gpio_driver"
+#define DRIVER_CLASS "MyModuleClass"
+
+#define MAX_DEVICES 32
+
+// Every device file (minor) drives one input and one output Gpio.
+// The amount of devices is the amount of input/output pairs given.
+static unsigned int input_gpios[MAX_DEVICES] = { 17 };
+static unsigned int output_gpios[MAX_DEVICES] = { 4 };
+static unsigned int nr_input_gpios = 1;
+static unsigned int nr_output_gpios = 1;
+
+module_param_array(input_gpios, uint, &nr_input_gpios, S_IRUGO);
+module_param_array(output_gpios, uint, &nr_output_gpios, S_IRUGO);
+MODULE_PARM_DESC(input_gpios, "Input Gpio ID of every device, comma separated");
+MODULE_PARM_DESC(output_gpios, "Output Gpio ID of every device, comma separated");
+
+// Longest debounce window
+#define MAX_DEBOUNCE_US 1000000
+
+static unsigned int default_debounce_us;
+module_param(default_debounce_us, uint, S_IRUGO);
+MODULE_PARM_DESC(default_debounce_us, "Initial debounce window of every input, in us. 0 disables it");
+
+// Banks of lines read or written at once with GPIO_BANK_GET and GPIO_BANK_SET,
+// on any of the devices. Line i of a bank is bit i of the bitmasks
+static unsigned int bank_in_gpios[GPIO_BANK_MAX_LINES];
+static unsigned int bank_out_gpios[GPIO_BANK_MAX_LINES];
+static unsigned int nr_bank_in_gpios;
+static unsigned int nr_bank_out_gpios;
+
+module_param_array(bank_in_gpios, uint, &nr_bank_in_gpios, S_IRUGO);
+module_param_array(bank_out_gpios, uint, &nr_bank_out_gpios, S_IRUGO);
+MODULE_PARM_DESC(bank_in_gpios, "Input Gpio IDs of the bank, comma separated. Bit i is the Gpio i of the list");
+MODULE_PARM_DESC(bank_out_gpios, "Output Gpio IDs of the bank, comma separated. Bit i is the Gpio i of the list");
+
+// Descriptors of the bank lines, for the gpiod array functions
+static struct gpio_desc * bank_in[GPIO_BANK_MAX_LINES];
+static struct gpio_desc * bank_out[GPIO_BANK_MAX_LINES];
+
+/**
+ * State of every device file (minor)
+ */
+struct driver_data {
+   struct cdev cdev;                // The device object
+   unsigned int minor;
+   unsigned int input_gpio;
+   unsigned int output_gpio;
+
+   // Edges of the input Gpio. The producers of the queue (the interrupt
+   // handler and the debounce timer) take debounce_lock, and the readers
+   // take read_lock among them
+   int irq;                         // Negative if the input has no usable IRQ
+   DECLARE_KFIFO(events, struct gpioEvent, GPIO_EVENT_QUEUE_SIZE);
+   u32 seq;
+   wait_queue_head_t event_wait;
+   struct mutex read_lock;
+   unsigned int event_files;        // Files in event mode. The IRQ is only enabled while there is any
+
+   // Debounce state machine. An edge starts a settling period, and every
+   // further edge starts it again. When the input has been quiet for a
+   // whole window, its level is compared with the last stable one
+   unsigned int debounce_us;        // Window. 0 passes every edge through
+   spinlock_t debounce_lock;
+   struct hrtimer debounce_timer;
+   bool settling;
+   int stable_level;
+   u64 first_edge_ns;               // First edge of the settling period
+
+   // Pattern engine for the output Gpio. The steps are queued by user space,
+   // with write() or through mmap(), and pattern_timer is the only consumer
+   struct gpio_pattern_ctrl * pattern_ctrl;
+   struct gpioStep * pattern_steps;
+   struct hrtimer pattern_timer;
+   ktime_t pattern_expected;        // When the step being played was due
+   atomic_t pattern_starved;        // Set by the timer when the ring ran dry while playing
+   struct mutex pattern_lock;       // Among writers, start and stop
+   wait_queue_head_t pattern_wait;  // Writers waiting for room in the ring
+};
+
+/**
+ * State of every open file
+ */
+struct gpio_client {
+   struct driver_data * dev;
+   bool events;                     // read() returns gpioEvent records instead of text
+   bool pattern;                    // write() takes gpioStep records instead of text
+};
+
+/**
+ * Counters of the module, one copy per CPU so that the read and write
+ * paths never share a cache line. Exposed in /sys/kernel/my_gpio/stats/
+ */
+struct driver_stats {
+   u64 reads;
+   u64 writes;
+   u64 errors;          // Invalid values written or failed copies
+   u64 edges;           // Interrupts of the input Gpios
+   u64 events_lost;     // Edges dropped because the queue was full
+   u64 events_read;     // Records returned by read()
+   u64 bank_sets;       // GPIO_BANK_SET calls
+   u64 bank_gets;       // GPIO_BANK_GET calls
+   u64 bounces;         // Edges that restarted a settling period
+   u64 glitches;        // Settling periods that ended at the stable level
+   u64 pattern_steps;   // Steps played
+   u64 pattern_underruns;     // Times the ring ran dry while playing
+   u64 pattern_jitter_max_ns; // Largest delay of a step. Per CPU, the maximum of all is shown
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Delay of every step from its due time, shown in /proc/hello/latency
+// when the procfs module (exercise 18) is loaded
+static struct latency_hist jitter_hist;
+
+// Latency of the read and write callbacks, shown there too
+static struct latency_hist read_hist;
+static struct latency_hist write_hist;
 
 // Variables for device and device class
-static dev_t my_device_nr;       // The device number assigned by the kernel
+static dev_t my_device_nr;       // The device number assigned by the kernel (first minor)
 static struct class *my_class;   // Pointer to the driver class 
-static struct cdev my_device;    // The device object
+static struct driver_data * my_devices;   // One per minor
+static unsigned int nr_devices;
 
-#define DRIVER_NAME "my_gpio_driver"
-#define DRIVER_CLASS "MyModuleClass"
+/**
+ * @brief Queue an edge for the readers. Called with debounce_lock held
+ */
+static void push_event(struct driver_data * dev, u64 timestamp_ns, int level)
+{
+   struct gpioEvent event = {
+      .timestamp_ns = timestamp_ns,
+      .seq = ++dev->seq,
+      .level = level
+   };
 
-#define INPUT_GPIO_ID 17
-#define OUTPUT_GPIO_ID 4
+   if(!kfifo_put(&dev->events, event))
+      STAT_INC(events_lost);
+   wake_up_interruptible_poll(&dev->event_wait, EPOLLIN | EPOLLRDNORM);
+}
 
 /**
- * @brief Read data. Used to read the INPUT Gpio value as text
+ * @brief Interrupt handler of the input Gpio, called on both edges.
+ * The timestamp is taken first, so it is as close to the edge as possible
  */
-static ssize_t driver_read(struct file * File, char * user_buffer, size_t count, loff_t * offset)
+static irqreturn_t edge_handler(int irq, void * dev_id)
+{
+   struct driver_data * dev = dev_id;
+   u64 now = ktime_get_ns();
+   unsigned int window = READ_ONCE(dev->debounce_us);
+
+   STAT_INC(edges);
+   spin_lock(&dev->debounce_lock);
+   if(window == 0)
+   {
+      dev->stable_level = gpio_get_value(dev->input_gpio);
+      push_event(dev, now, dev->stable_level);
+   }
+   else
+   {
+      // The input is stable once there is no edge for a whole window,
+      // so every edge moves the end of the settling period
+      if(dev->settling)
+      {
+         STAT_INC(bounces);
+      }
+      else
+      {
+         dev->settling = true;
+         dev->first_edge_ns = now;
+      }
+      hrtimer_start(&dev->debounce_timer, us_to_ktime(window), HRTIMER_MODE_REL);
+   }
+   spin_unlock(&dev->debounce_lock);
+
+   return IRQ_HANDLED;
+}
+
+/**
+ * @brief End of a settling period: the input has been quiet for a whole
+ * window. Only a change of the stable level reaches user space, with the
+ * time of the first edge of the period
+ */
+static enum hrtimer_restart debounce_function(struct hrtimer * timer)
+{
+   struct driver_data * dev = container_of(timer, struct driver_data, debounce_timer);
+   int level;
+
+   spin_lock(&dev->debounce_lock);
+
+   // An edge arrived while this callback was waiting for the lock, and
+   // started the timer again: the period isn't over yet
+   if(!dev->settling || hrtimer_is_queued(timer))
+   {
+      spin_unlock(&dev->debounce_lock);
+      return HRTIMER_NORESTART;
+   }
+
+   dev->settling = false;
+   level = gpio_get_value(dev->input_gpio);
+   if(level != dev->stable_level)
+   {
+      dev->stable_level = level;
+      push_event(dev, dev->first_edge_ns, level);
+   }
+   else
+   {
+      STAT_INC(glitches);     // A pulse shorter than the window
+   }
+   spin_unlock(&dev->debounce_lock);
+
+   return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Read as many edge records as fit in the buffer. Sleeps until there
+ * is at least one, unless the file was opened with O_NONBLOCK
+ */
+static ssize_t read_events(struct file * File, struct driver_data * dev, char __user * user_buffer, size_t count)
+{
+   unsigned int copied;
+   int ret;
+
+   if(count < sizeof(struct gpioEvent))
+      return -EINVAL;
+
+   for(;;)
+   {
+      if(mutex_lock_interruptible(&dev->read_lock))
+         return -ERESTARTSYS;
+      if(!kfifo_is_empty(&dev->events))
+         break;
+
+      mutex_unlock(&dev->read_lock);
+      if(File->f_flags & O_NONBLOCK)
+         return -EAGAIN;
+      if(wait_event_interruptible(dev->event_wait, !kfifo_is_empty(&dev->events)))
+         return -ERESTARTSYS;
+   }
+
+   // Only whole records are copied
+   ret = kfifo_to_user(&dev->events, user_buffer, count, &copied);
+   mutex_unlock(&dev->read_lock);
+   if(ret)
+   {
+      STAT_INC(errors);
+      return ret;
+   }
+
+   STAT_ADD(events_read, copied / sizeof(struct gpioEvent));
+   return copied;
+}
+
+/**
+ * @brief Read data. Used to read the INPUT Gpio value as text, or its
+ * edges in event mode
+ */
+static ssize_t do_read(struct file * File, char * user_buffer, size_t count, loff_t * offset)
 {
+   struct gpio_client * client = File->private_data;
+   struct driver_data * dev = client->dev;
+   u64 start = trace_my_gpio_read_enabled() ? ktime_get_ns() : 0;
    int to_copy, not_copied, gpio_value;
    char tmp[3] = " \n";
 
+   if(client->events)
+      return read_events(File, dev, user_buffer, count);
+
    // 1. Get the amount of data to copy
    to_copy = sizeof(tmp);
 
    // 2. Read actual value from the HW:
    // (easy way to convert the int to the ASCII value)
-   gpio_value = gpio_get_value(INPUT_GPIO_ID);
+   gpio_value = gpio_get_value(dev->input_gpio);
    tmp[0] = gpio_value + '0';
-   printk("Value of input gpio: %d\n", gpio_value);
+   if(start)
+      trace_my_gpio_read(dev->minor, dev->input_gpio, gpio_value, ktime_get_ns() - start);
 
    // 3. Copy the data to the user
    not_copied = copy_to_user(user_buffer, &tmp, to_copy);
 
+   STAT_INC(reads);
+   if(not_copied)
+      STAT_INC(errors);
+
    // 4. Return the amount of bytes read
    return 1;
 }
 
 /**
- * @brief Write data. Used to set the OUTPUT Gpio value
+ * @brief read callback. Its latency goes to the histogram, including the
+ * time blocked waiting for edges in event mode
  */
-static ssize_t driver_write(struct file * File, const char * user_buffer, size_t count, loff_t * offset)
+static ssize_t driver_read(struct file * File, char * user_buffer, size_t count, loff_t * offset)
+{
+   u64 start = ktime_get_ns();
+   ssize_t ret = do_read(File, user_buffer, count, offset);
+
+   latency_hist_record(&read_hist, ktime_get_ns() - start);
+   return ret;
+}
+
+/**
+ * @brief Amount of steps waiting in the ring. A writer using mmap() may
+ * have moved head anywhere, so never trust more than a full ring
+ */
+static inline u32 pattern_used(struct gpio_pattern_ctrl * ctrl)
+{
+   u32 tail = smp_load_acquire(&ctrl->tail);
+
+   return min_t(u32, READ_ONCE(ctrl->head) - tail, GPIO_PATTERN_ENTRIES);
+}
+
+/**
+ * @brief Play the next step of the pattern. The times are absolute: every
+ * step is due when the previous one was due plus its duration, so the
+ * delay of one expiry doesn't shift the rest of the waveform
+ */
+static enum hrtimer_restart pattern_function(struct hrtimer * timer)
 {
+   struct driver_data * dev = container_of(timer, struct driver_data, pattern_timer);
+   struct gpio_pattern_ctrl * ctrl = dev->pattern_ctrl;
+   u32 tail = ctrl->tail;
+   struct gpioStep step;
+   u64 jitter;
+
+   // 1. The writer didn't keep up: the last level stays until new steps
+   // restart the timer. Tell the writers first, then look again for steps
+   // published meanwhile. Whoever clears pattern_starved plays them
+   if(smp_load_acquire(&ctrl->head) == tail)
+   {
+      atomic_xchg(&dev->pattern_starved, 1);
+      if(smp_load_acquire(&ctrl->head) == tail || !atomic_xchg(&dev->pattern_starved, 0))
+      {
+         STAT_INC(pattern_underruns);
+         return HRTIMER_NORESTART;
+      }
+   }
+
+   // 2. Play the step, and give its slot back to the writers
+   step = dev->pattern_steps[tail & (GPIO_PATTERN_ENTRIES - 1)];
+   gpio_set_value(dev->output_gpio, step.level != 0);
+   smp_store_release(&ctrl->tail, tail + 1);
+   wake_up_interruptible_poll(&dev->pattern_wait, EPOLLOUT | EPOLLWRNORM);
+
+   jitter = ktime_to_ns(ktime_sub(ktime_get(), dev->pattern_expected));
+   latency_hist_record(&jitter_hist, jitter);
+   if(jitter > this_cpu_read(stats.pattern_jitter_max_ns))
+      this_cpu_write(stats.pattern_jitter_max_ns, jitter);
+   STAT_INC(pattern_steps);
+
+   // 3. Schedule the next step, unless this one ends the pattern
+   if(step.duration_ns == 0)
+      return HRTIMER_NORESTART;
+
+   dev->pattern_expected = ktime_add_ns(dev->pattern_expected, max_t(u32, step.duration_ns, GPIO_MIN_STEP_NS));
+   hrtimer_set_expires(timer, dev->pattern_expected);
+   return HRTIMER_RESTART;
+}
+
+/**
+ * @brief Restart the timer if it ran dry while playing. Called with
+ * pattern_lock held, once new steps are published. The time without steps
+ * is not made up: the next step is due now
+ */
+static void pattern_resume(struct driver_data * dev)
+{
+   if(atomic_xchg(&dev->pattern_starved, 0))
+   {
+      dev->pattern_expected = ktime_get();
+      hrtimer_start(&dev->pattern_timer, dev->pattern_expected, HRTIMER_MODE_ABS);
+   }
+}
+
+/**
+ * @brief Queue as many steps as fit in the ring. Sleeps until there is room
+ * for at least one, unless the file was opened with O_NONBLOCK
+ */
+static ssize_t write_steps(struct file * File, struct driver_data * dev, const char __user * user_buffer, size_t count)
+{
+   struct gpio_pattern_ctrl * ctrl = dev->pattern_ctrl;
+   u32 head, first, part, n;
+
+   if(count < sizeof(struct gpioStep))
+      return -EINVAL;
+
+   for(;;)
+   {
+      if(mutex_lock_interruptible(&dev->pattern_lock))
+         return -ERESTARTSYS;
+
+      head = READ_ONCE(ctrl->head);
+      n = min_t(size_t, GPIO_PATTERN_ENTRIES - pattern_used(ctrl), count / sizeof(struct gpioStep));
+      if(n > 0)
+         break;
+
+      mutex_unlock(&dev->pattern_lock);
+      if(File->f_flags & O_NONBLOCK)
+         return -EAGAIN;
+      if(wait_event_interruptible(dev->pattern_wait, pattern_used(ctrl) < GPIO_PATTERN_ENTRIES))
+         return -ERESTARTSYS;
+   }
+
+   // Copy in two parts if the steps wrap around the end of the ring
+   first = head & (GPIO_PATTERN_ENTRIES - 1);
+   part = min_t(u32, n, GPIO_PATTERN_ENTRIES - first);
+   if(copy_from_user(&dev->pattern_steps[first], user_buffer, part * sizeof(struct gpioStep)) ||
+      copy_from_user(dev->pattern_steps, user_buffer + part * sizeof(struct gpioStep), (n - part) * sizeof(struct gpioStep)))
+   {
+      mutex_unlock(&dev->pattern_lock);
+      STAT_INC(errors);
+      return -EFAULT;
+   }
+
+   // Publish the steps to the timer
+   smp_store_release(&ctrl->head, head + n);
+   pattern_resume(dev);
+   mutex_unlock(&dev->pattern_lock);
+
+   STAT_INC(writes);
+   return n * sizeof(struct gpioStep);
+}
+
+/**
+ * @brief Write data. Used to set the OUTPUT Gpio value, or to queue the
+ * steps of a pattern in pattern mode
+ */
+static ssize_t do_write(struct file * File, const char * user_buffer, size_t count, loff_t * offset)
+{
+   struct gpio_client * client = File->private_data;
+   struct driver_data * dev = client->dev;
+   u64 start = trace_my_gpio_write_enabled() ? ktime_get_ns() : 0;
    int to_copy, not_copied;
    char gpio_value;
 
+   if(client->pattern)
+      return write_steps(File, dev, user_buffer, count);
+
    // 1. Get the amount of data to copy
    to_copy = sizeof(gpio_value);
 
@@ -62,26 +484,287 @@ static ssize_t driver_write(struct file * File, const char * user_buffer, size_t
    switch(gpio_value)
    {
       case '0':
-         gpio_set_value(OUTPUT_GPIO_ID,0);
+         gpio_set_value(dev->output_gpio,0);
          break;
       case '1':
-         gpio_set_value(OUTPUT_GPIO_ID,1);
+         gpio_set_value(dev->output_gpio,1);
          break;
       default:
          printk("Invalid output value to be set\n");
+         STAT_INC(errors);
          break;
    }
+
+   if(start)
+      trace_my_gpio_write(dev->minor, dev->output_gpio, gpio_value - '0', ktime_get_ns() - start);
    
+   STAT_INC(writes);
+
    // 3. Return the amount of bytes written
    return 1;
 }
 
+/**
+ * @brief write callback, measured as driver_read
+ */
+static ssize_t driver_write(struct file * File, const char * user_buffer, size_t count, loff_t * offset)
+{
+   u64 start = ktime_get_ns();
+   ssize_t ret = do_write(File, user_buffer, count, offset);
+
+   latency_hist_record(&write_hist, ktime_get_ns() - start);
+   return ret;
+}
+
+/**
+ * @brief Start playing the ring, or resume a pattern that ran dry. Writers
+ * using mmap() call it again after moving head, as they can't resume it
+ */
+static long pattern_start(struct driver_data * dev)
+{
+   long ret = 0;
+
+   // The steps are played in hard IRQ context
+   if(gpio_cansleep(dev->output_gpio))
+      return -EOPNOTSUPP;
+
+   mutex_lock(&dev->pattern_lock);
+   if(pattern_used(dev->pattern_ctrl) == 0)
+   {
+      ret = -ENODATA;
+   }
+   else if(atomic_xchg(&dev->pattern_starved, 0) || !hrtimer_active(&dev->pattern_timer))
+   {
+      // The first step is due now
+      dev->pattern_expected = ktime_get();
+      hrtimer_start(&dev->pattern_timer, dev->pattern_expected, HRTIMER_MODE_ABS);
+   }
+   else
+   {
+      ret = -EBUSY;
+   }
+   mutex_unlock(&dev->pattern_lock);
+   return ret;
+}
+
+static long pattern_stop(struct driver_data * dev)
+{
+   struct gpio_pattern_ctrl * ctrl = dev->pattern_ctrl;
+
+   mutex_lock(&dev->pattern_lock);
+   hrtimer_cancel(&dev->pattern_timer);
+   atomic_set(&dev->pattern_starved, 0);
+
+   // The timer is stopped, so the tail can be moved here
+   smp_store_release(&ctrl->tail, READ_ONCE(ctrl->head));
+   mutex_unlock(&dev->pattern_lock);
+
+   wake_up_interruptible_poll(&dev->pattern_wait, EPOLLOUT | EPOLLWRNORM);
+   return 0;
+}
+
+static unsigned int driver_poll(struct file * File, poll_table * wait)
+{
+   struct gpio_client * client = File->private_data;
+   struct driver_data * dev = client->dev;
+   unsigned int mask = 0;
+
+   // The value can always be read and written without blocking
+   if(client->events)
+   {
+      poll_wait(File, &dev->event_wait, wait);
+      if(!kfifo_is_empty(&dev->events))
+         mask |= POLLIN | POLLRDNORM;
+   }
+   else
+   {
+      mask |= POLLIN | POLLRDNORM;
+   }
+
+   if(client->pattern)
+   {
+      poll_wait(File, &dev->pattern_wait, wait);
+      if(pattern_used(dev->pattern_ctrl) < GPIO_PATTERN_ENTRIES)
+         mask |= POLLOUT | POLLWRNORM;
+   }
+   else
+   {
+      mask |= POLLOUT | POLLWRNORM;
+   }
+
+   return mask;
+}
+
+/**
+ * @brief Map the control page and the ring of steps of the device
+ */
+static int driver_mmap(struct file * File, struct vm_area_struct * vma)
+{
+   struct gpio_client * client = File->private_data;
+
+   return remap_vmalloc_range(vma, client->dev->pattern_ctrl, vma->vm_pgoff);
+}
+
+/**
+ * @brief Switch a file in or out of event mode. The IRQ is enabled with
+ * the first file in event mode, and disabled again with the last one
+ */
+static long set_events(struct gpio_client * client, bool events)
+{
+   struct driver_data * dev = client->dev;
+
+   if(dev->irq < 0)
+      return -EOPNOTSUPP;
+
+   mutex_lock(&dev->read_lock);
+   if(events && !client->events)
+   {
+      // The IRQ is disabled and the timer stopped, so the queue has no
+      // producer and can be emptied of the edges of a previous session.
+      // The debouncer starts from the current level
+      if(dev->event_files++ == 0)
+      {
+         kfifo_reset(&dev->events);
+         dev->settling = false;
+         dev->stable_level = gpio_get_value(dev->input_gpio);
+         enable_irq(dev->irq);
+      }
+   }
+   else if(!events && client->events)
+   {
+      // disable_irq() also waits for a running handler to finish, so
+      // the timer can't be started again once cancelled
+      if(--dev->event_files == 0)
+      {
+         disable_irq(dev->irq);
+         hrtimer_cancel(&dev->debounce_timer);
+      }
+   }
+   client->events = events;
+   mutex_unlock(&dev->read_lock);
+   return 0;
+}
+
+/**
+ * @brief Bitmask with a bit for every line of a bank of n lines
+ */
+static inline u32 bank_lines(unsigned int n)
+{
+   return BIT_ULL(n) - 1;
+}
+
+/**
+ * @brief Set the output lines of the bank selected by the mask, with a single
+ * call to the gpiod array API. The selected lines are packed in order into a
+ * smaller array, so the lines out of the mask are not touched
+ */
+static long bank_set(struct gpioBank __user * arg)
+{
+   struct gpio_desc * descs[GPIO_BANK_MAX_LINES];
+   unsigned long values = 0, mask;
+   struct gpioBank bank;
+   unsigned int i, n = 0;
+   int ret;
+
+   if(copy_from_user(&bank, arg, sizeof(bank)))
+      return -EFAULT;
+   if(bank.mask & ~bank_lines(nr_bank_out_gpios))
+      return -EINVAL;
+
+   mask = bank.mask;
+   for_each_set_bit(i, &mask, GPIO_BANK_MAX_LINES)
+   {
+      descs[n] = bank_out[i];
+      if(bank.values & BIT(i))
+         __set_bit(n, &values);
+      n++;
+   }
+
+   STAT_INC(bank_sets);
+   if(n == 0)
+      return 0;
+
+   // The _cansleep variants also work for controllers behind a bus, as this is process context
+   ret = gpiod_set_array_value_cansleep(n, descs, NULL, &values);
+   if(ret)
+      STAT_INC(errors);
+   return ret;
+}
+
+/**
+ * @brief Read all the input lines of the bank with a single call
+ */
+static long bank_get(struct gpioBank __user * arg)
+{
+   struct gpioBank bank = { .mask = bank_lines(nr_bank_in_gpios) };
+   unsigned long values = 0;
+   int ret;
+
+   STAT_INC(bank_gets);
+   if(nr_bank_in_gpios)
+   {
+      ret = gpiod_get_array_value_cansleep(nr_bank_in_gpios, bank_in, NULL, &values);
+      if(ret)
+      {
+         STAT_INC(errors);
+         return ret;
+      }
+   }
+
+   bank.values = values;
+   if(copy_to_user(arg, &bank, sizeof(bank)))
+      return -EFAULT;
+   return 0;
+}
+
+static long int driver_ioctl(struct file * File, unsigned cmd, unsigned long arg)
+{
+   switch(cmd)
+   {
+      case GPIO_SET_EVENTS:
+         if(arg > 1)
+            return -EINVAL;
+         return set_events(File->private_data, arg);
+
+      case GPIO_BANK_SET:
+         return bank_set((struct gpioBank __user *) arg);
+
+      case GPIO_BANK_GET:
+         return bank_get((struct gpioBank __user *) arg);
+
+      case GPIO_SET_PATTERN:
+         if(arg > 1)
+            return -EINVAL;
+         ((struct gpio_client *) File->private_data)->pattern = arg;
+         return 0;
+
+      case GPIO_PATTERN_START:
+         return pattern_start(((struct gpio_client *) File->private_data)->dev);
+
+      case GPIO_PATTERN_STOP:
+         return pattern_stop(((struct gpio_client *) File->private_data)->dev);
+
+      default:
+         return -ENOTTY;
+   }
+}
+
 /**
  * @brief function called when the device file is opened
  */
 static int driver_open(struct inode * device_file, struct file * instance) 
 {
-   printk("read_write - open was called!\n");
+   // Every minor has its own cdev, embedded in its driver_data.
+   // From now on, the callbacks find their device here
+   struct driver_data * dev = container_of(device_file->i_cdev, struct driver_data, cdev);
+   struct gpio_client * client = kzalloc(sizeof(*client), GFP_KERNEL);
+
+   if(client == NULL)
+      return -ENOMEM;
+
+   client->dev = dev;
+   instance->private_data = client;
+   trace_my_gpio_open(dev->minor);
    return 0;
 }
 
@@ -90,7 +773,11 @@ static int driver_open(struct inode * device_file, struct file * instance)
  */
 static int driver_close(struct inode * device_file, struct file * instance) 
 {
-   printk("read_write - close was called!\n");
+   struct gpio_client * client = instance->private_data;
+
+   set_events(client, false);
+   trace_my_gpio_release(client->dev->minor);
+   kfree(client);
    return 0;
 }
 
@@ -99,100 +786,436 @@ static struct file_operations fops = {
    .open = driver_open,
    .release = driver_close,
    .read = driver_read,
-   .write = driver_write
+   .write = driver_write,
+   .poll = driver_poll,
+   .mmap = driver_mmap,
+   .unlocked_ioctl = driver_ioctl
 };
 
 #define MY_MAJOR 91     // Free device number. Check list in cat /proc/devices
 
 
 /**
- * @brief function called when the module is loaded into the kernel
+ * @brief Fold the per-CPU copies of one counter into its total
  */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
 
-static int __init myInit(void)
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+/**
+ * @brief Largest of the per-CPU copies of one maximum
+ */
+static u64 stats_max(size_t offset)
 {
-   printk("read_write - Hello mundo!\n");
+   u64 max = 0;
+   int cpu;
 
-   // 1. Allocate a device nr.
-   // The function will write the major and minor numbers in my_device_nr.
-   
-   if (alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0)
+   for_each_possible_cpu(cpu)
+      max = max_t(u64, max, *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset));
+   return max;
+}
+
+// Read-only attribute for a counter, named as the field of driver_stats
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(reads);
+STATS_ATTR(writes);
+STATS_ATTR(errors);
+STATS_ATTR(edges);
+STATS_ATTR(events_lost);
+STATS_ATTR(events_read);
+STATS_ATTR(bank_sets);
+STATS_ATTR(bank_gets);
+STATS_ATTR(bounces);
+STATS_ATTR(glitches);
+STATS_ATTR(pattern_steps);
+STATS_ATTR(pattern_underruns);
+
+static ssize_t pattern_jitter_max_ns_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer)
+{
+   return sprintf(buffer, "%llu\n", stats_max(offsetof(struct driver_stats, pattern_jitter_max_ns)));
+}
+static struct kobj_attribute pattern_jitter_max_ns_attr = __ATTR_RO(pattern_jitter_max_ns);
+
+static struct attribute * stats_attrs[] = {
+   &reads_attr.attr,
+   &writes_attr.attr,
+   &errors_attr.attr,
+   &edges_attr.attr,
+   &events_lost_attr.attr,
+   &events_read_attr.attr,
+   &bank_sets_attr.attr,
+   &bank_gets_attr.attr,
+   &bounces_attr.attr,
+   &glitches_attr.attr,
+   &pattern_steps_attr.attr,
+   &pattern_underruns_attr.attr,
+   &pattern_jitter_max_ns_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
+
+/**
+ * Debounce window of every device, in
+ * /sys/class/MyModuleClass/my_gpio_driver<N>/debounce_us
+ */
+static ssize_t debounce_us_show(struct device * d, struct device_attribute * attr, char * buffer)
+{
+   struct driver_data * dev = dev_get_drvdata(d);
+
+   return sprintf(buffer, "%u\n", READ_ONCE(dev->debounce_us));
+}
+
+static ssize_t debounce_us_store(struct device * d, struct device_attribute * attr, const char * buffer, size_t count)
+{
+   struct driver_data * dev = dev_get_drvdata(d);
+   unsigned int us;
+
+   if(kstrtouint(buffer, 0, &us) || us > MAX_DEBOUNCE_US)
+      return -EINVAL;
+
+   // Takes effect with the next edge
+   WRITE_ONCE(dev->debounce_us, us);
+   return count;
+}
+
+static DEVICE_ATTR_RW(debounce_us);
+
+static struct attribute * debounce_attrs[] = {
+   &dev_attr_debounce_us.attr,
+   NULL
+};
+ATTRIBUTE_GROUPS(debounce);
+
+/**
+ * @brief Request the IRQ of both edges of the input Gpio. It stays disabled
+ * until a file switches to event mode. Without it the device still works,
+ * only event mode is not available
+ */
+static void setup_edge_irq(struct driver_data * dev)
+{
+   dev->irq = -1;
+   INIT_KFIFO(dev->events);
+   init_waitqueue_head(&dev->event_wait);
+   mutex_init(&dev->read_lock);
+   spin_lock_init(&dev->debounce_lock);
+   hrtimer_init(&dev->debounce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   dev->debounce_timer.function = debounce_function;
+
+   // The level is read in the handler, in hard IRQ context
+   if(gpio_cansleep(dev->input_gpio))
    {
-      printk("Device Nr. could not be allocated!\n");
-      return -1;
+      printk("gpio - GPIO %u can sleep, no edge events\n", dev->input_gpio);
+      return;
    }
 
-   int major = my_device_nr >> 20;
-   int minor = my_device_nr & 0xFFFFF;
-   printk("read_write - Device Nr. Major: %d, Minor: %d, was registered\n", major, minor);
-   
-   // 2. Create device class
-   if((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL)
+   dev->irq = gpio_to_irq(dev->input_gpio);
+   if(dev->irq < 0)
    {
-      printk("Device class can not be created\n");
-      goto ClassError;
+      printk("gpio - GPIO %u has no IRQ, no edge events\n", dev->input_gpio);
+      return;
    }
 
-   // 3. Create device file
-   if(device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL)
+   if(request_irq(dev->irq, edge_handler, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "my_gpio_edge", dev))
    {
-      printk("Can not create device file\n");
-      goto FileError;
+      printk("gpio - IRQ %d of GPIO %u could not be requested\n", dev->irq, dev->input_gpio);
+      dev->irq = -1;
+      return;
    }
+   disable_irq(dev->irq);
+}
 
-   // 4. Initialize device file
-   cdev_init(&my_device, &fops);
-
-   // 5. Add the device file
-   if(cdev_add(&my_device, my_device_nr, 1) == -1)
+/**
+ * @brief Allocate the ring of steps of the pattern engine. vmalloc_user()
+ * returns zeroed memory that can be mapped. The control page comes first
+ * and the steps after it
+ */
+static int setup_pattern(struct driver_data * dev)
+{
+   dev->pattern_ctrl = vmalloc_user(PAGE_SIZE + GPIO_PATTERN_ENTRIES * sizeof(struct gpioStep));
+   if(dev->pattern_ctrl == NULL)
    {
-      printk("Registering of device to kernel failed!\n");
-      goto AddError;
+      printk("gpio - Pattern ring could not be allocated\n");
+      return -1;
    }
+   dev->pattern_steps = (struct gpioStep *) ((char *) dev->pattern_ctrl + PAGE_SIZE);
+   dev->pattern_ctrl->entries = GPIO_PATTERN_ENTRIES;
+   dev->pattern_ctrl->data_offset = PAGE_SIZE;
+
+   hrtimer_init(&dev->pattern_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   dev->pattern_timer.function = pattern_function;
+   atomic_set(&dev->pattern_starved, 0);
+   mutex_init(&dev->pattern_lock);
+   init_waitqueue_head(&dev->pattern_wait);
+   return 0;
+}
 
-   // 6. OUTPUT Gpio init
-   if(gpio_request(OUTPUT_GPIO_ID, "rpi-gpio-4"))
+/**
+ * @brief Request and configure the Gpios of a device
+ */
+static int setup_gpios(struct driver_data * dev)
+{
+   // OUTPUT Gpio init
+   if(gpio_request(dev->output_gpio, "rpi-gpio-out"))
    {
-      printk("Can not allocate GPIO 4\n");
-      goto AddError;
+      printk("Can not allocate GPIO %u\n", dev->output_gpio);
+      return -1;
    }
 
    // Set GPIO direction as OUTPUT and 0 as the initial value
-   if(gpio_direction_output(OUTPUT_GPIO_ID, 0))
+   if(gpio_direction_output(dev->output_gpio, 0))
    {
-      printk("Can not set GPIO 4 to output\n");
+      printk("Can not set GPIO %u to output\n", dev->output_gpio);
       goto GpioOutError;
    }
 
-   // 7. INPUT Gpio init:
-   if(gpio_request(INPUT_GPIO_ID, "rpi-gpio-17"))
+   // INPUT Gpio init:
+   if(gpio_request(dev->input_gpio, "rpi-gpio-in"))
    {
-      printk("Can not allocate input GPIO ID\n");
+      printk("Can not allocate input GPIO %u\n", dev->input_gpio);
       goto GpioOutError;
    }
 
    // Set GPIO direction as INPUT
-   if(gpio_direction_input(INPUT_GPIO_ID))
+   if(gpio_direction_input(dev->input_gpio))
    {
-      printk("Can not set GPIO To input\n");
+      printk("Can not set GPIO %u to input\n", dev->input_gpio);
       goto GpioInError;
    }
 
+   if(setup_pattern(dev))
+      goto GpioInError;
+
+   setup_edge_irq(dev);
+   return 0;
+
+GpioInError:
+   gpio_free(dev->input_gpio);
+GpioOutError:
+   gpio_free(dev->output_gpio);
+   return -1;
+}
+
+/**
+ * @brief Request the n Gpios of a bank, configure them and get their
+ * descriptors. Outputs start at 0
+ */
+static int setup_bank(unsigned int * gpios, unsigned int n, struct gpio_desc ** descs, bool output)
+{
+   unsigned int i;
+   int ret;
+
+   for(i = 0; i < n; i++)
+   {
+      if(gpio_request(gpios[i], output ? "my-gpio-bank-out" : "my-gpio-bank-in"))
+      {
+         printk("gpio - Can not allocate bank GPIO %u\n", gpios[i]);
+         goto BankError;
+      }
+
+      ret = output ? gpio_direction_output(gpios[i], 0) : gpio_direction_input(gpios[i]);
+      if(ret)
+      {
+         printk("gpio - Can not set the direction of bank GPIO %u\n", gpios[i]);
+         gpio_free(gpios[i]);
+         goto BankError;
+      }
+      descs[i] = gpio_to_desc(gpios[i]);
+   }
+   return 0;
+
+BankError:
+   while(i--)
+      gpio_free(gpios[i]);
+   return -1;
+}
+
+static void free_bank(unsigned int * gpios, unsigned int n)
+{
+   unsigned int i;
+
+   for(i = 0; i < n; i++)
+      gpio_free(gpios[i]);
+}
+
+/**
+ * @brief Undo setup_gpios
+ */
+static void release_gpios(struct driver_data * dev)
+{
+   hrtimer_cancel(&dev->pattern_timer);
+   vfree(dev->pattern_ctrl);
+   if(dev->irq >= 0)
+      free_irq(dev->irq, dev);
+   hrtimer_cancel(&dev->debounce_timer);
+   gpio_free(dev->input_gpio);
+   gpio_set_value(dev->output_gpio,0);
+   gpio_free(dev->output_gpio);
+}
+
+/**
+ * @brief Remove the first n device files and release their Gpios. The
+ * files go first, so that no callback runs while the Gpios are released
+ */
+static void destroy_devices(unsigned int n)
+{
+   unsigned int i;
+
+   for(i = 0; i < n; i++)
+   {
+      cdev_del(&my_devices[i].cdev);
+      device_destroy(my_class, my_device_nr + i);
+      release_gpios(&my_devices[i]);
+   }
+}
+
+/**
+ * @brief function called when the module is loaded into the kernel
+ */
+
+static int __init myInit(void)
+{
+   unsigned int i;
+
+   printk("read_write - Hello mundo!\n");
+
+   // 0. One device per input/output pair
+   if(nr_input_gpios != nr_output_gpios)
+   {
+      printk("gpio - input_gpios and output_gpios must have the same length\n");
+      return -EINVAL;
+   }
+   nr_devices = nr_input_gpios;
+
+   my_devices = kcalloc(nr_devices, sizeof(*my_devices), GFP_KERNEL);
+   if(my_devices == NULL)
+   {
+      printk("gpio - Device state could not be allocated!\n");
+      return -ENOMEM;
+   }
+
+   // 0b. The banks are ready before any device file can use them
+   if(setup_bank(bank_in_gpios, nr_bank_in_gpios, bank_in, false))
+      goto BankError;
+   if(setup_bank(bank_out_gpios, nr_bank_out_gpios, bank_out, true))
+   {
+      free_bank(bank_in_gpios, nr_bank_in_gpios);
+      goto BankError;
+   }
+
+   if(latency_hist_init(&jitter_hist, "gpio_pattern_jitter") ||
+      latency_hist_init(&read_hist, "my_gpio_read") ||
+      latency_hist_init(&write_hist, "my_gpio_write"))
+   {
+      printk("gpio - Latency histograms could not be allocated!\n");
+      goto RegionError;
+   }
+
+   // 1. Allocate a range of device numbers, one minor per device.
+   // The function will write the major and first minor numbers in my_device_nr.
+   
+   if (alloc_chrdev_region(&my_device_nr, 0, nr_devices, DRIVER_NAME) < 0)
+   {
+      printk("Device Nr. could not be allocated!\n");
+      goto RegionError;
+   }
+
+   int major = my_device_nr >> 20;
+   int minor = my_device_nr & 0xFFFFF;
+   printk("read_write - Device Nr. Major: %d, Minors: %d-%d, were registered\n", major, minor, minor + nr_devices - 1);
+   
+   // 2. Create device class
+   if((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL)
+   {
+      printk("Device class can not be created\n");
+      goto ClassError;
+   }
+
+   for(i = 0; i < nr_devices; i++)
+   {
+      struct driver_data * dev = &my_devices[i];
+
+      dev->minor = MINOR(my_device_nr) + i;
+      dev->input_gpio = input_gpios[i];
+      dev->output_gpio = output_gpios[i];
+      dev->debounce_us = min(default_debounce_us, (unsigned int) MAX_DEBOUNCE_US);
+
+      // 3. Gpios init. The locks, timers and queues used by the callbacks
+      // are ready before the device file and its attribute go live
+      if(setup_gpios(dev))
+      {
+         goto DevicesError;
+      }
+
+      // 4. Create device file: /dev/my_gpio_driver0, /dev/my_gpio_driver1...
+      // with its debounce_us attribute, which finds the device in drvdata
+      if(device_create_with_groups(my_class, NULL, my_device_nr + i, dev, debounce_groups, DRIVER_NAME "%u", i) == NULL)
+      {
+         printk("Can not create device file\n");
+         goto FileError;
+      }
+
+      // 5. Initialize device file
+      cdev_init(&dev->cdev, &fops);
+
+      // 6. Add the device file. From now on it can be opened
+      if(cdev_add(&dev->cdev, my_device_nr + i, 1) == -1)
+      {
+         printk("Registering of device to kernel failed!\n");
+         goto AddError;
+      }
+   }
+
+   // 7. Create /sys/kernel/my_gpio/stats
+   stats_kobj = kobject_create_and_add("my_gpio", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("gpio - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      goto DevicesError;
+   }
+
+   latency_hist_publish(&jitter_hist);
+   latency_hist_publish(&read_hist);
+   latency_hist_publish(&write_hist);
    return 0;
 
    // Error cases are managed with "goto" instructions so
    // that it is easy to undo all steps done so far at the 
    // moment of the error 
-GpioInError:
-   gpio_free(INPUT_GPIO_ID);
-GpioOutError:
-   gpio_free(OUTPUT_GPIO_ID);
 AddError:
-   device_destroy(my_class, my_device_nr);
+   device_destroy(my_class, my_device_nr + i);
 FileError:
+   release_gpios(&my_devices[i]);
+DevicesError:
+   destroy_devices(i);
    class_destroy(my_class);
 ClassError:
-   unregister_chrdev_region(my_device_nr, 1);
+   unregister_chrdev_region(my_device_nr, nr_devices);
+RegionError:
+   latency_hist_free(&write_hist);
+   latency_hist_free(&read_hist);
+   latency_hist_free(&jitter_hist);
+   free_bank(bank_out_gpios, nr_bank_out_gpios);
+   free_bank(bank_in_gpios, nr_bank_in_gpios);
+BankError:
+   kfree(my_devices);
    return -1;
 
 }
@@ -203,13 +1226,19 @@ ClassError:
 static void __exit myExit(void)
 {
    // Undo the steps done in myInit, in reverse order:
-   gpio_free(INPUT_GPIO_ID);
-   gpio_set_value(OUTPUT_GPIO_ID,0);
-   gpio_free(OUTPUT_GPIO_ID);
-   cdev_del(&my_device);
-   device_destroy(my_class, my_device_nr);
+   latency_hist_unpublish(&write_hist);
+   latency_hist_unpublish(&read_hist);
+   latency_hist_unpublish(&jitter_hist);
+   kobject_put(stats_kobj);
+   destroy_devices(nr_devices);
    class_destroy(my_class);
-   unregister_chrdev_region(my_device_nr, 1);
+   unregister_chrdev_region(my_device_nr, nr_devices);
+   latency_hist_free(&write_hist);
+   latency_hist_free(&read_hist);
+   latency_hist_free(&jitter_hist);
+   free_bank(bank_out_gpios, nr_bank_out_gpios);
+   free_bank(bank_in_gpios, nr_bank_in_gpios);
+   kfree(my_devices);
    printk("read_write - bye bye!\n");
    return;
 }
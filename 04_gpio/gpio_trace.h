@@ -0,0 +1,69 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM my_gpio
+
+#if !defined(_MY_GPIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MY_GPIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Enable with: echo 1 > /sys/kernel/tracing/events/my_gpio/enable
+
+DECLARE_EVENT_CLASS(my_gpio_file,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+   ),
+   TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(my_gpio_file, my_gpio_open,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor)
+);
+
+DEFINE_EVENT(my_gpio_file, my_gpio_release,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor)
+);
+
+// A Gpio value read by driver_read or set by driver_write
+DECLARE_EVENT_CLASS(my_gpio_value,
+   TP_PROTO(unsigned int minor, unsigned int gpio, int value, u64 latency_ns),
+   TP_ARGS(minor, gpio, value, latency_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+      __field(unsigned int, gpio)
+      __field(int, value)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+      __entry->gpio = gpio;
+      __entry->value = value;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("minor=%u gpio=%u value=%d latency_ns=%llu",
+      __entry->minor, __entry->gpio, __entry->value, __entry->latency_ns)
+);
+
+DEFINE_EVENT(my_gpio_value, my_gpio_read,
+   TP_PROTO(unsigned int minor, unsigned int gpio, int value, u64 latency_ns),
+   TP_ARGS(minor, gpio, value, latency_ns)
+);
+
+DEFINE_EVENT(my_gpio_value, my_gpio_write,
+   TP_PROTO(unsigned int minor, unsigned int gpio, int value, u64 latency_ns),
+   TP_ARGS(minor, gpio, value, latency_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpio_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,78 @@
+#ifndef MY_GPIO_H
+#define MY_GPIO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DEVICE_FILE_NAME "/dev/my_gpio_driver0"
+
+// Record of an edge of the input Gpio, returned by read() in event mode.
+// A read returns as many records as fit in the buffer
+struct gpioEvent
+{
+    __u64 timestamp_ns;     // CLOCK_MONOTONIC time of the interrupt
+    __u32 seq;              // Sequence number. A gap means that edges were lost
+    __u32 level;            // Value of the input after the edge
+};
+
+// Capacity of the event queue of every device (power of two).
+// Edges arriving while it is full are dropped
+#define GPIO_EVENT_QUEUE_SIZE 1024
+
+// Choose what read() returns on this file: 0 for the value of the input as
+// text (the default), 1 for the gpioEvent records of its edges
+#define GPIO_SET_EVENTS _IO('G', 'e')
+
+// Maximum amount of lines of a bank, one bit of the bitmasks each
+#define GPIO_BANK_MAX_LINES 32
+
+// Lines of a bank, given with the module parameters bank_in_gpios and
+// bank_out_gpios. Bit i stands for the line i of the list
+struct gpioBank
+{
+    __u32 mask;             // Lines to set. GPIO_BANK_GET returns the lines of the bank
+    __u32 values;           // Their values
+};
+
+#define GPIO_BANK_SET _IOW('G', 's', struct gpioBank)     // Set the output lines in mask at once
+#define GPIO_BANK_GET _IOR('G', 'g', struct gpioBank)     // Read all the input lines at once
+
+// Step of a waveform played on the output Gpio: the level is set, and kept
+// for duration_ns. A step with duration 0 sets its level and ends the pattern
+struct gpioStep
+{
+    __u32 level;
+    __u32 duration_ns;
+};
+
+// Shortest step. Shorter durations are played with this one
+#define GPIO_MIN_STEP_NS 10000
+
+// Amount of steps in the ring of every device (power of two)
+#define GPIO_PATTERN_ENTRIES 4096
+
+// Layout of the area mapped with mmap() on the device:
+// - Offset 0: control page, holding a struct gpio_pattern_ctrl
+// - Offset data_offset: the ring, entries struct gpioStep long
+struct gpio_pattern_ctrl
+{
+    __u32 entries;
+    __u32 data_offset;
+
+    // Indexes run freely: the step of index i is at i & (entries - 1)
+    // and head - tail is the amount of steps waiting to be played
+    __u32 head __attribute__((aligned(64)));    // Written by the writer
+    __u32 tail __attribute__((aligned(64)));    // Written by the driver
+};
+
+// Choose what write() takes on this file: 0 for a value as text (the
+// default), 1 for gpioStep records, queued in the ring
+#define GPIO_SET_PATTERN _IO('G', 'w')
+
+// Play the steps in the ring, and the ones added later. If the ring runs
+// dry, write() resumes the pattern; after moving head through mmap(), call
+// it again to do the same
+#define GPIO_PATTERN_START _IO('G', 'a')
+#define GPIO_PATTERN_STOP  _IO('G', 'o')     // Stop, dropping the steps not played
+
+#endif
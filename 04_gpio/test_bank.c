@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+
+#include "my_gpio.h"
+
+int main(int argc, char * argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    struct gpioBank bank;
+    struct timespec start, end;
+
+    int fd = open(DEVICE_FILE_NAME, O_RDWR);
+    if (fd == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    if (ioctl(fd, GPIO_BANK_GET, &bank) < 0)
+    {
+        perror("GPIO_BANK_GET failed");
+        close(fd);
+        return -1;
+    }
+    printf("Input bank: lines 0x%08x, values 0x%08x\n", bank.mask, bank.values);
+
+    // Count on the whole output bank: every call updates all the lines at once.
+    // A mask of ~0 is refused unless the bank has 32 lines, so all the
+    // bits are set until the call succeeds
+    bank.mask = 0xFFFFFFFF;
+    bank.values = 0;
+    while (bank.mask && ioctl(fd, GPIO_BANK_SET, &bank) < 0)
+    {
+        bank.mask >>= 1;
+    }
+    if (bank.mask == 0)
+    {
+        printf("No output bank. Load the module with bank_out_gpios=...\n");
+        close(fd);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++)
+    {
+        bank.values = i;
+        if (ioctl(fd, GPIO_BANK_SET, &bank) < 0)
+        {
+            perror("GPIO_BANK_SET failed");
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d updates of %d lines (mask 0x%08x) in %.3f s: %.0f updates/s\n",
+           iterations, __builtin_popcount(bank.mask), bank.mask, seconds, iterations / seconds);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+
+#include "my_gpio.h"
+
+#define BATCH 64
+
+int main(int argc, char * argv[])
+{
+    const char * path = argc > 1 ? argv[1] : DEVICE_FILE_NAME;
+    int count = argc > 2 ? atoi(argv[2]) : 20;
+    struct gpioEvent events[BATCH];
+    struct pollfd pfd = { .events = POLLIN };
+    uint64_t previous = 0;
+    uint32_t last_seq = 0;
+
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    if (ioctl(fd, GPIO_SET_EVENTS, 1) < 0)
+    {
+        perror("Error enabling the edge events");
+        close(fd);
+        return -1;
+    }
+
+    // Sleep in poll() until there are edges, then take all of them at once
+    pfd.fd = fd;
+    while (count > 0)
+    {
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            perror("poll failed");
+            break;
+        }
+
+        ssize_t n = read(fd, events, sizeof(events));
+        if (n < 0)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < n / sizeof(struct gpioEvent) && count > 0; i++, count--)
+        {
+            if (last_seq && events[i].seq != last_seq + 1)
+            {
+                printf("%u edges lost\n", events[i].seq - last_seq - 1);
+            }
+            printf("seq %u: level %u at %llu ns (+%llu us)\n", events[i].seq, events[i].level,
+                   (unsigned long long) events[i].timestamp_ns,
+                   (unsigned long long) (previous ? (events[i].timestamp_ns - previous) / 1000 : 0));
+            previous = events[i].timestamp_ns;
+            last_seq = events[i].seq;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+
+#include "my_gpio.h"
+
+#define BATCH 256
+
+// Step i of a square wave: the level alternates, the last step ends the pattern
+static struct gpioStep square_step(long i, long steps, uint32_t half_period_ns)
+{
+    struct gpioStep step = {
+        .level = i & 1 ? 0 : 1,
+        .duration_ns = i == steps - 1 ? 0 : half_period_ns
+    };
+    return step;
+}
+
+// Queue the steps with write(). It blocks while the ring is full, so the
+// writer runs just ahead of the timer
+static int play_write(int fd, long steps, uint32_t half_period_ns)
+{
+    struct gpioStep batch[BATCH];
+    long queued = 0, written;
+    int started = 0;
+
+    if (ioctl(fd, GPIO_SET_PATTERN, 1) < 0)
+    {
+        perror("GPIO_SET_PATTERN failed");
+        return -1;
+    }
+
+    while (queued < steps)
+    {
+        long n = steps - queued < BATCH ? steps - queued : BATCH;
+
+        for (long i = 0; i < n; i++)
+        {
+            batch[i] = square_step(queued + i, steps, half_period_ns);
+        }
+
+        // write() may take only part of the batch
+        for (written = 0; written < n; )
+        {
+            ssize_t ret = write(fd, batch + written, (n - written) * sizeof(struct gpioStep));
+            if (ret < 0)
+            {
+                perror("write failed");
+                return -1;
+            }
+            written += ret / sizeof(struct gpioStep);
+
+            // Start as soon as there are steps queued
+            if (!started && ioctl(fd, GPIO_PATTERN_START) == 0)
+            {
+                started = 1;
+            }
+        }
+        queued += n;
+    }
+    return 0;
+}
+
+// Queue the steps directly in the mapped ring, without any copy
+static int play_mmap(int fd, long steps, uint32_t half_period_ns)
+{
+    size_t size = sysconf(_SC_PAGESIZE) + GPIO_PATTERN_ENTRIES * sizeof(struct gpioStep);
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+    // poll() only waits for room in pattern mode
+    if (ioctl(fd, GPIO_SET_PATTERN, 1) < 0)
+    {
+        perror("GPIO_SET_PATTERN failed");
+        return -1;
+    }
+
+    void * area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return -1;
+    }
+
+    struct gpio_pattern_ctrl * ctrl = area;
+    struct gpioStep * ring = (struct gpioStep *) ((char *) area + ctrl->data_offset);
+
+    for (long i = 0; i < steps; )
+    {
+        uint32_t head = ctrl->head;
+        uint32_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+
+        if (head - tail == ctrl->entries)
+        {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        for (; head - tail < ctrl->entries && i < steps; head++, i++)
+        {
+            ring[head & (ctrl->entries - 1)] = square_step(i, steps, half_period_ns);
+        }
+        // Publish the steps to the timer, and resume it if the ring ran dry
+        // (it fails with EBUSY while the pattern is playing)
+        __atomic_store_n(&ctrl->head, head, __ATOMIC_RELEASE);
+        ioctl(fd, GPIO_PATTERN_START);
+    }
+
+    munmap(area, size);
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    int use_mmap = argc > 1 && strcmp(argv[1], "mmap") == 0;
+    long steps = argc > 2 ? atol(argv[2]) : 100000;
+    uint32_t half_period_ns = (argc > 3 ? atol(argv[3]) : 50) * 1000;  // In us
+    int ret;
+
+    int fd = open(DEVICE_FILE_NAME, O_RDWR);
+    if (fd == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    ret = use_mmap ? play_mmap(fd, steps, half_period_ns) : play_write(fd, steps, half_period_ns);
+    if (ret == 0)
+    {
+        printf("%ld steps of %u ns queued (%s)\n", steps, half_period_ns, use_mmap ? "mmap" : "write");
+        printf("See /sys/kernel/my_gpio/stats/pattern_* once the pattern has been played\n");
+    }
+
+    close(fd);
+    return ret;
+}
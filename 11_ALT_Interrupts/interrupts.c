@@ -1,40 +1,643 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/atomic.h>
+#include <linux/math64.h>
+
+#include "irq_events.h"
+#include "../18_Procfs/latency_hist.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("Simple example of interrupt handling");
 
+#define DRIVER_NAME "irq_events"
+#define DRIVER_CLASS "MyModuleClass"
+
 // Keyboard always uses IRQ ID 1, according to ISA list
-#define IRQ_ID 1
+static int irq = 1;
+module_param(irq, int, 0444);
+MODULE_PARM_DESC(irq, "IRQ to listen to, shared with its driver");
+
+// Without special hardware, interrupts can be simulated with irq_work
+static bool test_mode;
+module_param(test_mode, bool, 0444);
+MODULE_PARM_DESC(test_mode, "Don't request any IRQ, generate software interrupts with IRQ_TEST_TRIGGER");
+
+// Samples that each CPU can hold until the thread takes them. Power of 2
+#define IRQ_RING_SIZE 256
+
+/**
+ * Coalescing: the thread is woken up once every coalesce_events interrupts,
+ * or coalesce_usecs after the first interrupt it hasn't seen, whichever comes
+ * first. In adaptive mode, coalesce_events follows the rate of interrupts.
+ * All of them can be changed in /sys/module/interrupts/parameters/
+ */
+static unsigned int coalesce_events = 1;
+module_param(coalesce_events, uint, 0644);
+MODULE_PARM_DESC(coalesce_events, "Interrupts per wake up of the thread (1 wakes it up every time)");
+
+static unsigned int coalesce_usecs = 1000;
+module_param(coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(coalesce_usecs, "Maximum time an interrupt waits for the thread, in us");
+
+static bool adaptive;
+module_param(adaptive, bool, 0644);
+MODULE_PARM_DESC(adaptive, "Raise the threshold of events as the rate of interrupts climbs");
+
+// Half a ring, so that a burst on a single CPU doesn't fill it before the thread runs
+#define COALESCE_MAX_EVENTS (IRQ_RING_SIZE / 2)
+
+struct irq_sample {
+   u64 timestamp_ns;       // When the top half ran
+};
+
+/**
+ * Ring of samples of one CPU. The top half, running on that CPU, is the only
+ * producer, and the IRQ thread the only consumer, so no lock is needed:
+ * each index is only written by one side, and published with release/acquire
+ */
+struct irq_ring {
+   u32 head;               // Written by the top half
+   u32 tail;               // Written by the thread
+   atomic_t pending;       // Interrupts the thread hasn't been woken up for, reset by the thread
+   struct irq_sample samples[IRQ_RING_SIZE];
+};
+
+static DEFINE_PER_CPU(struct irq_ring, rings);
+
+// Wakes up the thread when the events don't reach the threshold in time
+static struct hrtimer coalesce_timer;
+
+// Threshold of the adaptive mode, updated by the thread
+static unsigned int adaptive_events = 1;
+static u64 rate_ewma;            // Interrupts per second
+static u64 last_batch_ns;
+
+/**
+ * Ring of records read by user space, with read() or mmap(). The bottom
+ * half is its only producer. The readers of read() take read_lock among
+ * them; a reader using mmap() moves tail by itself
+ */
+static struct irq_event_ctrl * event_ctrl;
+static struct irqEvent * event_data;
+static u64 event_seq;                  // Only used by the bottom half
+static DEFINE_MUTEX(read_lock);
+static DECLARE_WAIT_QUEUE_HEAD(read_wait);
+
+/**
+ * Per-CPU counters, shown as totals in /sys/kernel/interrupts/stats/
+ */
+struct driver_stats {
+   u64 irqs;            // Interrupts seen by the top half
+   u64 dropped;         // Samples lost because the ring of the CPU was full
+   u64 processed;       // Samples processed by the thread
+   u64 batches;         // Runs of the thread
+   u64 lost;            // Records lost because user space didn't read them in time
+   u64 events_read;     // Records returned by read()
+   u64 wakeups;         // Wake ups of the thread because the threshold was reached
+   u64 timer_flushes;   // Wake ups of the thread by the coalescing timer
+   u64 coalesced;       // Interrupts that didn't wake up the thread by themselves
+};
 
-// Interruption handler
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Time spent in the top half, and time from the top half to the processing
+// in the thread, shown in /proc/hello/latency when the procfs module
+// (exercise 18) is loaded
+static struct latency_hist top_half_hist;
+static struct latency_hist thread_hist;
+
+// Variables for device and device class
+static dev_t my_device_nr;
+static struct class * my_class;
+static struct cdev my_device;
+
+// Test mode: the irq_work plays the top half and the work item the thread
+static struct irq_work test_irq_work;
+static struct work_struct test_work;
+
+
+/**
+ * @brief Store a sample in the ring of the current CPU. Runs in hard IRQ
+ * context with the line masked, so it doesn't do anything else.
+ * Returns true when the thread has to be woken up now
+ */
+static bool record_sample(u64 timestamp)
+{
+   struct irq_ring * ring = this_cpu_ptr(&rings);
+   u32 head = ring->head;
+   unsigned int threshold, count;
+
+   if(head - smp_load_acquire(&ring->tail) >= IRQ_RING_SIZE)
+   {
+      STAT_INC(dropped);
+   }
+   else
+   {
+      ring->samples[head & (IRQ_RING_SIZE - 1)].timestamp_ns = timestamp;
+      smp_store_release(&ring->head, head + 1);
+   }
+   STAT_INC(irqs);
+
+   // 1. Count the interrupt after storing it: the thread takes the count
+   // before the samples, so it never misses a sample it has counted. The
+   // count is per CPU, so its cache line only moves when the thread resets it
+   count = atomic_inc_return(&ring->pending);
+   threshold = adaptive ? READ_ONCE(adaptive_events) : READ_ONCE(coalesce_events);
+
+   // Only the interrupt that reaches the threshold wakes up the thread. If
+   // the threshold changes under the batch, the timer still wakes it up
+   if(count == clamp(threshold, 1U, (unsigned int) COALESCE_MAX_EVENTS))
+   {
+      STAT_INC(wakeups);
+      return true;
+   }
+
+   // 2. The first interrupt of a batch sets the deadline of the whole batch.
+   // The timer is shared, so the other CPUs don't move it once it is queued
+   if(count == 1 && !hrtimer_is_queued(&coalesce_timer))
+      hrtimer_start(&coalesce_timer, us_to_ktime(READ_ONCE(coalesce_usecs)), HRTIMER_MODE_REL);
+   STAT_INC(coalesced);
+   return false;
+}
+
+/**
+ * @brief Top half, shared by the real and the simulated interrupts. It
+ * records how long it takes, which is the time the line stays masked
+ * because of this driver
+ */
+static bool top_half(void)
+{
+   u64 start = ktime_get_ns();
+   bool wake = record_sample(start);
+
+   latency_hist_record(&top_half_hist, ktime_get_ns() - start);
+   return wake;
+}
+
+static enum hrtimer_restart coalesce_function(struct hrtimer * timer)
+{
+   STAT_INC(timer_flushes);
+   if(test_mode)
+      schedule_work(&test_work);
+   else
+      irq_wake_thread(irq, THIS_MODULE);
+   return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Adaptive mode: estimate the rate of interrupts with a moving
+ * average, and set the threshold to the interrupts expected in
+ * coalesce_usecs. A slow rate gives 1, waking up the thread every time
+ */
+static void adapt_threshold(unsigned int processed, u64 now)
+{
+   u64 elapsed = now - last_batch_ns;
+   u64 events;
+
+   last_batch_ns = now;
+   if(elapsed == 0)
+      return;
+
+   rate_ewma = (3 * rate_ewma + div64_u64((u64) processed * NSEC_PER_SEC, elapsed)) / 4;
+   events = div64_u64(rate_ewma * READ_ONCE(coalesce_usecs), USEC_PER_SEC);
+   WRITE_ONCE(adaptive_events, clamp_t(u64, events, 1, COALESCE_MAX_EVENTS));
+}
+
+/**
+ * @brief Turn the samples queued in the rings of all CPUs into records for
+ * user space, so a burst of interrupts is processed in a single run
+ */
+static void process_samples(u32 irq_no)
+{
+   u32 ev_head = event_ctrl->head;
+   u32 ev_tail = smp_load_acquire(&event_ctrl->tail);
+   unsigned int processed = 0, lost = 0;
+   u64 now;
+   int cpu;
+
+   // The timer is cancelled first, so that an interrupt arriving after the
+   // count of its CPU is taken starts it again
+   hrtimer_try_to_cancel(&coalesce_timer);
+   now = ktime_get_ns();
+
+   for_each_possible_cpu(cpu)
+   {
+      struct irq_ring * ring = per_cpu_ptr(&rings, cpu);
+      u32 head, tail;
+
+      // Take the count of pending interrupts of the CPU before its samples
+      atomic_xchg(&ring->pending, 0);
+      head = smp_load_acquire(&ring->head);
+      tail = ring->tail;
+
+      for(; tail != head; tail++, processed++)
+      {
+         u64 timestamp = ring->samples[tail & (IRQ_RING_SIZE - 1)].timestamp_ns;
+         struct irqEvent * event;
+
+         latency_hist_record(&thread_hist, now - timestamp);
+
+         // The sequence number goes on, so the reader sees the gap
+         event_seq++;
+         if(ev_head - ev_tail >= IRQ_EVENT_ENTRIES)
+         {
+            lost++;
+            continue;
+         }
+
+         event = &event_data[ev_head++ & (IRQ_EVENT_ENTRIES - 1)];
+         event->timestamp_ns = timestamp;
+         event->seq = event_seq;
+         event->irq = irq_no;
+         event->cpu = cpu;
+         event->latency_ns = min_t(u64, now - timestamp, U32_MAX);
+      }
+
+      // Give the slots back to the top half
+      smp_store_release(&ring->tail, tail);
+   }
+
+   // Publish all the records of the batch at once, and wake up the readers once
+   smp_store_release(&event_ctrl->head, ev_head);
+   if(processed > lost)
+      wake_up_interruptible_poll(&read_wait, EPOLLIN | EPOLLRDNORM);
+
+   if(adaptive)
+      adapt_threshold(processed, now);
+
+   STAT_INC(batches);
+   STAT_ADD(processed, processed);
+   if(lost)
+      STAT_ADD(lost, lost);
+   printk_ratelimited("interrupts - Processed %u interrupts with ID %d\n", processed, irq_no);
+}
+
+// Interruption handler, top half
 static irqreturn_t myHandler(int irq_no, void * dev_id)
 {
-   printk("Interrputed with interrupt ID: %d!\n", irq_no);
+   // The original drivers still process the interruption: returning
+   // IRQ_WAKE_THREAD doesn't prevent the other handlers of the line from running
+   if(top_half())
+      return IRQ_WAKE_THREAD;
+
+   // Coalesced: the thread runs later, on the threshold or the timer
+   return IRQ_HANDLED;
+}
+
+// Bottom half, run by the IRQ thread in process context
+static irqreturn_t myThread(int irq_no, void * dev_id)
+{
+   process_samples(irq_no);
+   return IRQ_HANDLED;
+}
+
+// Test mode. The irq_work callback runs in hard IRQ context too
+static void test_irq_function(struct irq_work * work)
+{
+   if(top_half())
+      schedule_work(&test_work);
+}
+
+static void test_work_function(struct work_struct * work)
+{
+   process_samples(IRQ_EVENT_TEST);
+}
+
+/**
+ * @brief Amount of records to read. A reader using mmap() may have moved
+ * tail anywhere, so never trust more than a full ring
+ */
+static inline u32 events_used(u32 head, u32 tail)
+{
+   return min_t(u32, head - tail, IRQ_EVENT_ENTRIES);
+}
+
+/**
+ * @brief Copy count records, starting at index tail, to the user buffer,
+ * in two parts if they wrap around the end of the ring
+ */
+static int events_to_user(char __user * buffer, u32 tail, u32 count)
+{
+   u32 first = tail & (IRQ_EVENT_ENTRIES - 1);
+   u32 part = min_t(u32, count, IRQ_EVENT_ENTRIES - first);
+
+   if(copy_to_user(buffer, &event_data[first], part * sizeof(struct irqEvent)))
+      return -EFAULT;
+   if(copy_to_user(buffer + part * sizeof(struct irqEvent), event_data, (count - part) * sizeof(struct irqEvent)))
+      return -EFAULT;
+   return 0;
+}
+
+/**
+ * @brief Read as many records as fit in the buffer. Sleeps until there is at
+ * least one, unless the file was opened with O_NONBLOCK
+ */
+static ssize_t driver_read(struct file * File, char __user * user_buffer, size_t count, loff_t * offs)
+{
+   u32 head, tail, n;
+   int ret;
+
+   if(count < sizeof(struct irqEvent))
+      return -EINVAL;
+
+   for(;;)
+   {
+      if(mutex_lock_interruptible(&read_lock))
+         return -ERESTARTSYS;
+
+      tail = event_ctrl->tail;
+      head = smp_load_acquire(&event_ctrl->head);
+      n = min_t(size_t, events_used(head, tail), count / sizeof(struct irqEvent));
+      if(n > 0)
+         break;
 
-   // Return IRQ_NONE so that the original drivers still have
-   // the chance to process the interruption.
-   return IRQ_NONE;
+      mutex_unlock(&read_lock);
+      if(File->f_flags & O_NONBLOCK)
+         return -EAGAIN;
+      if(wait_event_interruptible(read_wait, smp_load_acquire(&event_ctrl->head) != READ_ONCE(event_ctrl->tail)))
+         return -ERESTARTSYS;
+   }
+
+   ret = events_to_user(user_buffer, tail, n);
+   if(ret == 0)
+      smp_store_release(&event_ctrl->tail, tail + n);    // Hand the slots back to the producer
+   mutex_unlock(&read_lock);
+   if(ret)
+      return ret;
+
+   STAT_ADD(events_read, n);
+   return n * sizeof(struct irqEvent);
 }
 
+static unsigned int driver_poll(struct file * File, poll_table * wait)
+{
+   u32 head, tail;
+
+   poll_wait(File, &read_wait, wait);
+
+   // Load tail first: head only grows, so head - tail can't underflow
+   tail = smp_load_acquire(&event_ctrl->tail);
+   head = smp_load_acquire(&event_ctrl->head);
+   return events_used(head, tail) ? POLLIN | POLLRDNORM : 0;
+}
+
+/**
+ * @brief Map the control page and the ring into user space. The records
+ * can be read in place there, moving tail when done with them
+ */
+static int driver_mmap(struct file * File, struct vm_area_struct * vma)
+{
+   // Mapping the ring for writing is only needed to update tail
+   return remap_vmalloc_range(vma, event_ctrl, vma->vm_pgoff);
+}
+
+static long int driver_ioctl(struct file * File, unsigned cmd, unsigned long arg)
+{
+   u32 count, i;
+
+   switch(cmd)
+   {
+      case IRQ_TEST_TRIGGER:
+         if(!test_mode)
+            return -EPERM;
+         if(copy_from_user(&count, (u32 __user *) arg, sizeof(count)))
+            return -EFAULT;
+         if(count == 0 || count > IRQ_TEST_MAX)
+            return -EINVAL;
+
+         // Wait for every interrupt before raising the next one: an irq_work
+         // that is still pending can't be queued again
+         for(i = 0; i < count; i++)
+         {
+            irq_work_queue(&test_irq_work);
+            irq_work_sync(&test_irq_work);
+            if((i & 255) == 255)
+               cond_resched();
+         }
+         return 0;
+
+      default:
+         return -ENOTTY;
+   }
+}
+
+static struct file_operations fops = {
+   .owner = THIS_MODULE,
+   .read = driver_read,
+   .poll = driver_poll,
+   .mmap = driver_mmap,
+   .unlocked_ioctl = driver_ioctl
+};
+
+/**
+ * @brief Add up the per-CPU copies of a counter
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(irqs);
+STATS_ATTR(dropped);
+STATS_ATTR(processed);
+STATS_ATTR(batches);
+STATS_ATTR(lost);
+STATS_ATTR(events_read);
+STATS_ATTR(wakeups);
+STATS_ATTR(timer_flushes);
+STATS_ATTR(coalesced);
+
+// Threshold in use, which changes with the rate in adaptive mode
+static ssize_t threshold_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer)
+{
+   unsigned int threshold = adaptive ? READ_ONCE(adaptive_events) : READ_ONCE(coalesce_events);
+
+   return sprintf(buffer, "%u\n", clamp(threshold, 1U, (unsigned int) COALESCE_MAX_EVENTS));
+}
+static struct kobj_attribute threshold_attr = __ATTR_RO(threshold);
+
+static struct attribute * stats_attrs[] = {
+   &irqs_attr.attr,
+   &dropped_attr.attr,
+   &processed_attr.attr,
+   &batches_attr.attr,
+   &lost_attr.attr,
+   &events_read_attr.attr,
+   &wakeups_attr.attr,
+   &timer_flushes_attr.attr,
+   &coalesced_attr.attr,
+   &threshold_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
 static int __init myInit(void)
 {
+   int error = -ENOMEM;
+
    printk("interrupts - initializing\n");
 
-   // Request with IRQF_SHARED to indicate that this IRQ
-   // is shared with other drivers. We don't want exclusivity
-   int error = request_irq(IRQ_ID, myHandler, IRQF_SHARED, "my_kbd_handler", THIS_MODULE);
+   if(latency_hist_init(&top_half_hist, "interrupts_top_half") ||
+      latency_hist_init(&thread_hist, "interrupts_irq_to_thread"))
+      goto HistError;
+
+   // 1. Allocate the ring for user space. vmalloc_user() returns zeroed memory
+   // that can be mapped. The control page comes first and the records after it
+   event_ctrl = vmalloc_user(PAGE_SIZE + IRQ_EVENT_ENTRIES * sizeof(struct irqEvent));
+   if(event_ctrl == NULL)
+      goto HistError;
+   event_data = (struct irqEvent *) ((char *) event_ctrl + PAGE_SIZE);
+   event_ctrl->entries = IRQ_EVENT_ENTRIES;
+   event_ctrl->data_offset = PAGE_SIZE;
+
+   // 2. Create /sys/kernel/interrupts/stats
+   stats_kobj = kobject_create_and_add("interrupts", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("interrupts - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      goto StatsError;
+   }
+
+   // 3. Create /dev/irq_events
+   if(alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0)
+   {
+      printk("interrupts - Device Nr. could not be allocated!\n");
+      goto RegionError;
+   }
 
-   return error;     // 0 if success
+   if((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL)
+   {
+      printk("interrupts - Device class can not be created\n");
+      goto ClassError;
+   }
+
+   if(device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL)
+   {
+      printk("interrupts - Can not create device file\n");
+      goto FileError;
+   }
+
+   cdev_init(&my_device, &fops);
+   if(cdev_add(&my_device, my_device_nr, 1) == -1)
+   {
+      printk("interrupts - Registering of device to kernel failed!\n");
+      goto AddError;
+   }
+
+   // 4. Request the IRQ, or get ready to simulate it. The coalescing
+   // timer wakes up the thread, so it must be ready before the first interrupt
+   hrtimer_init(&coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   coalesce_timer.function = coalesce_function;
+   last_batch_ns = ktime_get_ns();
+
+   if(test_mode)
+   {
+      init_irq_work(&test_irq_work, test_irq_function);
+      INIT_WORK(&test_work, test_work_function);
+      printk("interrupts - Test mode, no IRQ requested\n");
+   }
+   else
+   {
+      // Request with IRQF_SHARED to indicate that this IRQ
+      // is shared with other drivers. We don't want exclusivity.
+      // myThread will run in a kernel thread each time myHandler
+      // returns IRQ_WAKE_THREAD
+      error = request_threaded_irq(irq, myHandler, myThread, IRQF_SHARED, "my_kbd_handler", THIS_MODULE);
+      if(error)
+      {
+         printk("interrupts - IRQ %d could not be requested!\n", irq);
+         goto IrqError;
+      }
+   }
+
+   latency_hist_publish(&top_half_hist);
+   latency_hist_publish(&thread_hist);
+   return 0;
+
+IrqError:
+   cdev_del(&my_device);
+AddError:
+   device_destroy(my_class, my_device_nr);
+FileError:
+   class_destroy(my_class);
+ClassError:
+   unregister_chrdev_region(my_device_nr, 1);
+RegionError:
+   kobject_put(stats_kobj);
+StatsError:
+   vfree(event_ctrl);
+HistError:
+   latency_hist_free(&thread_hist);
+   latency_hist_free(&top_half_hist);
+   return error;
 }
 
 static void __exit myExit(void)
 {
    printk("interrupts - exiting!\n");
 
-   free_irq(IRQ_ID, THIS_MODULE);
+   // Stop the producers first. free_irq() also waits for the thread to finish
+   // The timer is cancelled once no interrupt can start it again
+   if(test_mode)
+   {
+      irq_work_sync(&test_irq_work);
+      hrtimer_cancel(&coalesce_timer);
+      cancel_work_sync(&test_work);
+   }
+   else
+   {
+      free_irq(irq, THIS_MODULE);
+      hrtimer_cancel(&coalesce_timer);
+   }
+
+   latency_hist_unpublish(&thread_hist);
+   latency_hist_unpublish(&top_half_hist);
+   cdev_del(&my_device);
+   device_destroy(my_class, my_device_nr);
+   class_destroy(my_class);
+   unregister_chrdev_region(my_device_nr, 1);
+   kobject_put(stats_kobj);
+   vfree(event_ctrl);
+   latency_hist_free(&thread_hist);
+   latency_hist_free(&top_half_hist);
 
    return;
 }
@@ -0,0 +1,45 @@
+#ifndef IRQ_EVENTS_H
+#define IRQ_EVENTS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DEVICE_FILE_NAME "/dev/irq_events"
+
+// Record of an interrupt, as returned by read() and stored in the ring
+struct irqEvent
+{
+    __u64 timestamp_ns;     // CLOCK_MONOTONIC time when the top half ran
+    __u64 seq;              // Sequence number. A gap means that records were lost
+    __u32 irq;              // IRQ number, or IRQ_EVENT_TEST for software interrupts
+    __u32 cpu;              // CPU that ran the top half
+    __u32 latency_ns;       // Time from the top half to the thread
+    __u32 reserved;
+};
+
+#define IRQ_EVENT_TEST 0xFFFFFFFF
+
+// Amount of records in the ring (power of two)
+#define IRQ_EVENT_ENTRIES 4096
+
+// Layout of the area mapped with mmap() on the device:
+// - Offset 0: control page, holding a struct irq_event_ctrl
+// - Offset data_offset: the ring, entries struct irqEvent long
+struct irq_event_ctrl
+{
+    __u32 entries;
+    __u32 data_offset;
+
+    // Indexes run freely: the record of index i is at i & (entries - 1)
+    // and head - tail is the amount of records stored
+    __u32 head __attribute__((aligned(64)));    // Written by the driver
+    __u32 tail __attribute__((aligned(64)));    // Written by the reader
+};
+
+// In test mode, trigger the amount of software interrupts passed as argument
+#define IRQ_TEST_TRIGGER _IOW('i', 't', __u32)
+
+// Maximum amount of interrupts triggered by a single IRQ_TEST_TRIGGER
+#define IRQ_TEST_MAX 65536
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+
+#include "irq_events.h"
+
+#define BATCH 256
+
+static uint64_t last_seq, received, lost, max_latency, sum_latency;
+
+static void account(const struct irqEvent * event)
+{
+    // The sequence numbers of the driver have no gaps, so a jump is the
+    // amount of records lost because the ring was full
+    if (last_seq && event->seq != last_seq + 1)
+    {
+        lost += event->seq - last_seq - 1;
+    }
+    last_seq = event->seq;
+    received++;
+    sum_latency += event->latency_ns;
+    if (event->latency_ns > max_latency)
+    {
+        max_latency = event->latency_ns;
+    }
+}
+
+// Take the records with read(), many of them per call
+static int read_events(int fd, uint64_t count)
+{
+    struct irqEvent events[BATCH];
+
+    while (received < count)
+    {
+        ssize_t n = read(fd, events, sizeof(events));
+        if (n < 0)
+        {
+            perror("read failed");
+            return -1;
+        }
+        for (size_t i = 0; i < n / sizeof(struct irqEvent); i++)
+        {
+            account(&events[i]);
+        }
+    }
+    return 0;
+}
+
+// Take the records in place from the mapped ring, without any copy.
+// poll() is only used to sleep when the ring is empty
+static int mmap_events(int fd, uint64_t count)
+{
+    size_t size = sysconf(_SC_PAGESIZE) + IRQ_EVENT_ENTRIES * sizeof(struct irqEvent);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    void * area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return -1;
+    }
+
+    struct irq_event_ctrl * ctrl = area;
+    struct irqEvent * ring = (struct irqEvent *) ((char *) area + ctrl->data_offset);
+
+    while (received < count)
+    {
+        uint32_t tail = ctrl->tail;
+        uint32_t head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail)
+        {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        for (; tail != head; tail++)
+        {
+            account(&ring[tail & (ctrl->entries - 1)]);
+        }
+        // Hand the slots back to the driver once the records are read
+        __atomic_store_n(&ctrl->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    munmap(area, size);
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    int use_mmap = argc > 1 && strcmp(argv[1], "mmap") == 0;
+    uint64_t count = argc > 2 ? atoll(argv[2]) : 100;
+    int ret;
+
+    int fd = open(DEVICE_FILE_NAME, O_RDWR);
+    if (fd == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    // When the module was loaded with test_mode=1, raise the interrupts here.
+    // Otherwise, they come from the real IRQ (press some keys)
+    if (fork() == 0)
+    {
+        uint32_t trigger = count < IRQ_TEST_MAX ? count : IRQ_TEST_MAX;
+
+        if (ioctl(fd, IRQ_TEST_TRIGGER, &trigger) < 0)
+        {
+            printf("Not in test mode, waiting for %llu real interrupts\n", (unsigned long long) count);
+        }
+        return 0;
+    }
+
+    ret = use_mmap ? mmap_events(fd, count) : read_events(fd, count);
+
+    printf("%llu records (%s), %llu lost, latency avg %llu ns, max %llu ns\n",
+           (unsigned long long) received, use_mmap ? "mmap" : "read", (unsigned long long) lost,
+           (unsigned long long) (received ? sum_latency / received : 0),
+           (unsigned long long) max_latency);
+
+    close(fd);
+    return ret;
+}
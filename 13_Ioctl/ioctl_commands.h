@@ -1,16 +1,45 @@
 #ifndef IOCTL_TEST_H
 #define IOCTL_TEST_H
 
+#include <linux/types.h>
+
 struct myStruct
 {
     int repeat;
     char name[64];
 };
 
+// Table of values kept by the module. WR_VALUE and RD_VALUE use slot 0
+#define NR_VALUES 1024
+
+// Maximum amount of entries in a single batch
+#define MAX_BATCH 65536
+
+// One element of a batch: the slot of the table and its value
+struct batchEntry
+{
+    __u32 index;
+    __s32 value;
+};
+
+// Descriptor of a batch, passed to WR_BATCH and RD_BATCH
+struct batchDesc
+{
+    __u64 entries;      // Pointer to an array of count struct batchEntry
+    __u64 status;       // Pointer to an array of count __s32: 0 or -errno per entry
+    __u32 count;
+    __u32 flags;        // BATCH_* flags
+};
+
+// Stop at the first failing entry. The rest get -ECANCELED as status
+#define BATCH_STOP_ON_ERROR 0x1
+
 // The kernel will generate a unique number for every command
 
 #define WR_VALUE _IOW('a', 'b', int32_t *)
 #define RD_VALUE _IOR('a', 'b', int32_t *)
 #define GREETER  _IOW('a', 'c', struct mystruct *)
+#define WR_BATCH _IOW('a', 'd', struct batchDesc *)      // Store entries[i].value in the slots
+#define RD_BATCH _IOWR('a', 'e', struct batchDesc *)     // Fill entries[i].value from the slots
 
-#endif
\ No newline at end of file
+#endif
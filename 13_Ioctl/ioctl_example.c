@@ -3,19 +3,49 @@
 #include <linux/fs.h>
 #include <linux/ioctl.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/nospec.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
 
 #include "ioctl_commands.h"
+#include "../18_Procfs/latency_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "ioctl_example_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("A simple example for ioctl in a LKM");
 
+/**
+ * Per-CPU counters: my_ioctl only touches the copy of the CPU it runs on.
+ * The totals are computed when reading /sys/kernel/ioctl_example/stats/
+ */
+struct driver_stats {
+   u64 ioctls;
+   u64 batch_entries;   // Entries processed by WR_BATCH and RD_BATCH
+   u64 errors;          // Calls returning an error
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Latency of the ioctl calls, shown in /proc/hello/latency
+static struct latency_hist ioctl_hist;
+
 /**
  * @brief function called when the device file is opened
  */
 static int driver_open(struct inode * device_file, struct file * instance) 
 {
-   printk("ioctl_example - open was called!\n");
+   trace_ioctl_example_open(iminor(device_file));
    return 0;
 }
 
@@ -24,58 +54,154 @@ static int driver_open(struct inode * device_file, struct file * instance)
  */
 static int driver_close(struct inode * device_file, struct file * instance) 
 {
-   printk("ioctl_example - close was called!\n");
+   trace_ioctl_example_release(iminor(device_file));
    return 0;
 }
 
-// Global variable for reading and writing:
-int32_t answer = 42;
+// Global table for reading and writing. WR_VALUE and RD_VALUE use slot 0,
+// WR_BATCH and RD_BATCH any of them:
+int32_t answers[NR_VALUES] = { 42 };
+
+/**
+ * @brief Process a WR_BATCH or RD_BATCH command. The whole vector of entries
+ * is copied in and out once, instead of paying one ioctl call per value
+ */
+static long int run_batch(unsigned cmd, unsigned long arg)
+{
+   struct batchDesc desc;
+   struct batchEntry * entries;
+   int32_t * status;
+   bool cancel = false;
+   long int ret = 0;
+   u32 i, index;
+
+   // 1. Get the descriptor and check it
+   if(copy_from_user(&desc, (struct batchDesc *) arg, sizeof(desc)))
+      return -EFAULT;
+
+   if(desc.count == 0 || desc.count > MAX_BATCH || (desc.flags & ~BATCH_STOP_ON_ERROR))
+      return -EINVAL;
+
+   // 2. Copy all the entries at once
+   entries = kvmalloc_array(desc.count, sizeof(*entries), GFP_KERNEL);
+   status = kvmalloc_array(desc.count, sizeof(*status), GFP_KERNEL);
+   if(entries == NULL || status == NULL)
+   {
+      ret = -ENOMEM;
+      goto Free;
+   }
+
+   if(copy_from_user(entries, u64_to_user_ptr(desc.entries), desc.count * sizeof(*entries)))
+   {
+      ret = -EFAULT;
+      goto Free;
+   }
+
+   // 3. Process them, with a status for every one
+   for(i = 0; i < desc.count; i++)
+   {
+      if(cancel)
+      {
+         status[i] = -ECANCELED;
+         continue;
+      }
+
+      index = entries[i].index;
+      if(index >= NR_VALUES)
+      {
+         status[i] = -EINVAL;
+         cancel = desc.flags & BATCH_STOP_ON_ERROR;
+         continue;
+      }
+      // The index comes from user space: don't let the CPU speculate past the check
+      index = array_index_nospec(index, NR_VALUES);
+
+      if(cmd == WR_BATCH)
+         answers[index] = entries[i].value;
+      else
+         entries[i].value = answers[index];
+      status[i] = 0;
+   }
+
+   STAT_ADD(batch_entries, desc.count);
+
+   // 4. Copy the results back. Only RD_BATCH modifies the entries
+   if(cmd == RD_BATCH &&
+      copy_to_user(u64_to_user_ptr(desc.entries), entries, desc.count * sizeof(*entries)))
+   {
+      ret = -EFAULT;
+      goto Free;
+   }
+
+   if(copy_to_user(u64_to_user_ptr(desc.status), status, desc.count * sizeof(*status)))
+   {
+      ret = -EFAULT;
+   }
+
+Free:
+   kvfree(entries);
+   kvfree(status);
+   return ret;
+}
 
 
 // Standard definition of a ioctl call: file pointer, command and arg(s)
-static long int my_ioctl(struct file * file, unsigned cmd, unsigned long arg)
+static long int do_ioctl(struct file * file, unsigned cmd, unsigned long arg)
 {
    struct myStruct test;
 
+   // No logging here: every call is reported by the ioctl_example_cmd
+   // tracepoint instead, with its result
    switch(cmd)
    {
       case WR_VALUE:
-         if(copy_from_user(&answer, (int32_t *) arg, sizeof(answer)))
-         {
-            printk("ioctl_example - Error copying data from user!\n");
-         }
-         else
-         {
-            printk("ioctl_example - update the answer to %d\n", answer);
-         }
+         if(copy_from_user(&answers[0], (int32_t *) arg, sizeof(answers[0])))
+            return -EFAULT;
          break;
 
       case RD_VALUE:
-         if(copy_to_user((int32_t *) arg, &answer, sizeof(answer)))
-         {
-            printk("ioctl_example - Error copying data to user!\n");
-         }
-         else
-         {
-            printk("ioctl_example - the answer was copied\n");
-         }
+         if(copy_to_user((int32_t *) arg, &answers[0], sizeof(answers[0])))
+            return -EFAULT;
          break;
 
       case GREETER:
          if(copy_from_user(&test, (struct myStruct *) arg, sizeof(test)))
          {
-            printk("ioctl_example - Error copying data from user!\n");
+            return -EFAULT;
          }
          else
          {
             printk("ioctl_example - %d greets to %s\n", test.repeat, test.name);
          }
          break;
+
+      case WR_BATCH:
+      case RD_BATCH:
+         return run_batch(cmd, arg);
    }
 
    return 0;
 }
 
+/**
+ * @brief ioctl callback. Its latency goes to the histogram and,
+ * when enabled, to the tracepoint
+ */
+static long int my_ioctl(struct file * file, unsigned cmd, unsigned long arg)
+{
+   u64 start = ktime_get_ns();
+   long int ret = do_ioctl(file, cmd, arg);
+   u64 latency = ktime_get_ns() - start;
+
+   latency_hist_record(&ioctl_hist, latency);
+   trace_ioctl_example_cmd(cmd, ret, latency);
+
+   STAT_INC(ioctls);
+   if(ret < 0)
+      STAT_INC(errors);
+   return ret;
+}
+
 
 static struct file_operations fops = {
    .owner = THIS_MODULE,
@@ -87,6 +213,43 @@ static struct file_operations fops = {
 #define MY_MAJOR 91     // Free device number. Check list in cat /proc/devices
 
 
+/**
+ * @brief Total of one counter, adding up the copies of all CPUs
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(ioctls);
+STATS_ATTR(batch_entries);
+STATS_ATTR(errors);
+
+static struct attribute * stats_attrs[] = {
+   &ioctls_attr.attr,
+   &batch_entries_attr.attr,
+   &errors_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
+
 /**
  * @brief function called when the module is loaded into the kernel
  */
@@ -96,6 +259,9 @@ static int __init myInit(void)
    int retVal;
    printk("ioctl_example - Hello mundo!\n");
 
+   if(latency_hist_init(&ioctl_hist, "ioctl_example_ioctl"))
+      return -ENOMEM;
+
    // Register the device number for a new character device
    retVal = register_chrdev(MY_MAJOR, "my_ioctl_example", &fops);
 
@@ -118,8 +284,23 @@ static int __init myInit(void)
    else
    {
       printk("ioctl_example - Could not register device number!\n");
+      latency_hist_free(&ioctl_hist);
       return -1;
    }
+
+   // Create /sys/kernel/ioctl_example/stats
+   stats_kobj = kobject_create_and_add("ioctl_example", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("ioctl_example - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      unregister_chrdev(MY_MAJOR, "my_ioctl_example");
+      latency_hist_free(&ioctl_hist);
+      return -ENOMEM;
+   }
+
+   // Show the latencies in /proc/hello/latency, if the procfs module is loaded
+   latency_hist_publish(&ioctl_hist);
    return 0;
 }
 
@@ -129,7 +310,10 @@ static int __init myInit(void)
 static void __exit myExit(void)
 {
    // Unregister our device
+   latency_hist_unpublish(&ioctl_hist);
+   kobject_put(stats_kobj);
    unregister_chrdev(MY_MAJOR, "my_ioctl_example");
+   latency_hist_free(&ioctl_hist);
    printk("ioctl_example - Nos vamos!\n");
    return;
 }
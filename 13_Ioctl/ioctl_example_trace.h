@@ -0,0 +1,56 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ioctl_example
+
+#if !defined(_IOCTL_EXAMPLE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IOCTL_EXAMPLE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Enable with: echo 1 > /sys/kernel/tracing/events/ioctl_example/enable
+
+DECLARE_EVENT_CLASS(ioctl_example_file,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+   ),
+   TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(ioctl_example_file, ioctl_example_open,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor)
+);
+
+DEFINE_EVENT(ioctl_example_file, ioctl_example_release,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor)
+);
+
+// Every ioctl call: the command, its result and how long it took
+TRACE_EVENT(ioctl_example_cmd,
+   TP_PROTO(unsigned int cmd, long ret, u64 latency_ns),
+   TP_ARGS(cmd, ret, latency_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, cmd)
+      __field(long, ret)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->cmd = cmd;
+      __entry->ret = ret;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("cmd=0x%x ret=%ld latency_ns=%llu", __entry->cmd, __entry->ret, __entry->latency_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ioctl_example_trace
+#include <trace/define_trace.h>
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include <sys/ioctl.h>      // To allow issuing ioctl commands
 #include "ioctl_commands.h"
@@ -32,6 +33,44 @@ int main()
     // Test greeter command
     ioctl(dev, GREETER, &test);
 
+    // Test batch commands: write 8 slots in one call, then read them back.
+    // The last entry uses an invalid slot to see its status
+    struct batchEntry entries[8];
+    int32_t status[8];
+    struct batchDesc desc = {
+        .entries = (uintptr_t) entries,
+        .status = (uintptr_t) status,
+        .count = 8,
+        .flags = 0
+    };
+
+    for (int i = 0; i < 8; i++)
+    {
+        entries[i].index = i + 1;
+        entries[i].value = (i + 1) * 100;
+    }
+    entries[7].index = NR_VALUES;
+
+    if (ioctl(dev, WR_BATCH, &desc) < 0)
+    {
+        perror("WR_BATCH failed");
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        entries[i].value = 0;
+    }
+
+    if (ioctl(dev, RD_BATCH, &desc) < 0)
+    {
+        perror("RD_BATCH failed");
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        printf("Slot %u: value %d, status %d\n", entries[i].index, entries[i].value, status[i]);
+    }
+
     printf("Opening successful!\n");
 
     close(dev);
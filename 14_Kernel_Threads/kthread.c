@@ -2,80 +2,532 @@
 #include <linux/init.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
-#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/kobject.h>
+
+#include "kthread_pool.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
-MODULE_DESCRIPTION("A simple example for threads in a LKM");
+MODULE_DESCRIPTION("A pool of kernel threads, one per CPU, with work stealing");
+
+#define DRIVER_NAME "kthread_pool"
+#define DRIVER_CLASS "MyModuleClass"
+
+/**
+ * State of every open file. The jobs submitted through a file keep a
+ * reference to it, so it lives until the file is closed and all its
+ * jobs are done
+ */
+struct pool_client {
+   refcount_t refs;              // One for the file, one per queued or running job
+   atomic_t pending;             // Jobs submitted and not completed yet
+   atomic64_t jobs;              // Jobs completed since the last POOL_WAIT
+   atomic64_t checksum;          // Sum of their results
+   wait_queue_head_t done;       // Woken when pending reaches 0
+   bool closed;                  // Jobs of a closed file are dropped without running
+};
+
+struct pool_job {
+   struct list_head list;
+   struct pool_client * client;
+   u64 seed;
+   u32 rounds;
+};
+
+/**
+ * One worker per CPU. Its deque is only locked by the owner, which pushes and
+ * pops at the tail, and by the thieves, which take the oldest half from the
+ * head. The lock is per CPU, so workers don't contend unless they steal
+ */
+struct pool_worker {
+   spinlock_t lock;
+   struct list_head jobs;
+   unsigned int nr_jobs;         // Length of jobs
+   wait_queue_head_t wait;       // The worker sleeps here when there is no work
+   bool may_steal;               // Set by POOL_SUBMIT, cleared before every steal
+   struct task_struct * task;
+   unsigned int cpu;
+};
+
+static DEFINE_PER_CPU(struct pool_worker, workers);
+static struct cpumask pool_cpus;       // CPUs with a running worker
+
+/**
+ * Per-CPU counters, shown in /sys/kernel/kthread_pool/stats/
+ */
+struct driver_stats {
+   u64 submitted;       // Jobs queued by POOL_SUBMIT
+   u64 executed;        // Jobs run by the worker of this CPU
+   u64 steals;          // Successful steals by the worker of this CPU
+   u64 stolen_jobs;     // Jobs moved by those steals
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Variables for device and device class
+static dev_t my_device_nr;
+static struct class * my_class;
+static struct cdev my_device;
+
+
+static void client_put(struct pool_client * client, unsigned int n)
+{
+   if(refcount_sub_and_test(n, &client->refs))
+      kfree(client);
+}
+
+/**
+ * @brief The work of a job: a splitmix64 sequence, added up
+ */
+static u64 run_job(struct pool_job * job)
+{
+   u64 x = job->seed, sum = 0;
+   u32 i;
+
+   for(i = 0; i < job->rounds; i++)
+   {
+      u64 z = (x += 0x9E3779B97F4A7C15ULL);
+
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      sum += z ^ (z >> 31);
+
+      // Long jobs must not hog the CPU
+      if((i & 0xFFFF) == 0xFFFF)
+         cond_resched();
+   }
+   return sum;
+}
+
+/**
+ * @brief Account a finished job in its client and free it
+ */
+static void finish_job(struct pool_job * job, u64 result)
+{
+   struct pool_client * client = job->client;
+
+   atomic64_add(result, &client->checksum);
+   atomic64_inc(&client->jobs);
+   if(atomic_dec_and_test(&client->pending))
+      wake_up(&client->done);
+
+   kfree(job);
+   client_put(client, 1);
+}
+
+/**
+ * @brief Take the newest job of the own deque, which is the most likely to
+ * still be in the cache
+ */
+static struct pool_job * pool_pop(struct pool_worker * w)
+{
+   struct pool_job * job = NULL;
 
-// Global variables for the threads:
-static struct task_struct * kthread_1;
-static struct task_struct * kthread_2;
-static int t1 = 1;         // Thread number for thread 1
-static int t2 = 2;         // Thread number for thread 2
+   spin_lock(&w->lock);
+   if(!list_empty(&w->jobs))
+   {
+      job = list_last_entry(&w->jobs, struct pool_job, list);
+      list_del(&job->list);
+      w->nr_jobs--;
+   }
+   spin_unlock(&w->lock);
+
+   return job;
+}
+
+/**
+ * @brief Move the oldest half of the jobs of victim to the deque of thief
+ */
+static bool steal_from(struct pool_worker * victim, struct pool_worker * thief)
+{
+   struct pool_job * job;
+   LIST_HEAD(stolen);
+   unsigned int n, i = 0;
+
+   // Cheap check without the lock, to skip the idle workers
+   if(READ_ONCE(victim->nr_jobs) == 0)
+      return false;
+
+   spin_lock(&victim->lock);
+   n = (victim->nr_jobs + 1) / 2;
+   if(n > 0)
+   {
+      list_for_each_entry(job, &victim->jobs, list)
+      {
+         if(++i == n)
+            break;
+      }
+      list_cut_position(&stolen, &victim->jobs, &job->list);
+      victim->nr_jobs -= n;
+   }
+   spin_unlock(&victim->lock);
+
+   if(n == 0)
+      return false;
+
+   spin_lock(&thief->lock);
+   list_splice_tail(&stolen, &thief->jobs);
+   thief->nr_jobs += n;
+   spin_unlock(&thief->lock);
+
+   STAT_INC(steals);
+   STAT_ADD(stolen_jobs, n);
+   return true;
+}
+
+/**
+ * @brief Look for work in the other workers, starting with the next CPU
+ * so that the thieves don't all go for the same victim
+ */
+static bool pool_steal(struct pool_worker * thief)
+{
+   unsigned int cpu = thief->cpu;
+
+   for(;;)
+   {
+      cpu = cpumask_next(cpu, &pool_cpus);
+      if(cpu >= nr_cpu_ids)
+         cpu = cpumask_first(&pool_cpus);
+      if(cpu == thief->cpu)
+         return false;
+
+      if(steal_from(per_cpu_ptr(&workers, cpu), thief))
+         return true;
+   }
+}
 
-// Function that will be executed by the thread
-// Args must be passed as void pointers
-int thread_function(void * data)
+/**
+ * @brief Function executed by every worker thread. It runs jobs while there
+ * are any, and sleeps until new ones are queued otherwise
+ */
+static int worker_function(void * data)
 {
-   unsigned int i = 0;           // counter
-   int t_nr = *(int *) data;     // Thread number
+   struct pool_worker * w = data;
+   struct pool_job * job;
 
-   // Working loop:
    while(!kthread_should_stop())
    {
-      // Do something with the counter and print it
-      printk("kthread - Thread %d is executed! Counter val: %d\n", t_nr, i++);
-      // Delay time depending on thread number
-      msleep(t_nr * 1000);
+      job = pool_pop(w);
+      if(job == NULL)
+      {
+         // Only sleep until there are jobs in the own deque, or a submit
+         // that may have left some to steal. The flag is cleared before
+         // looking, so a steal that fails can't be retried in a loop
+         smp_store_mb(w->may_steal, false);
+         if(!pool_steal(w))
+            wait_event_interruptible(w->wait, kthread_should_stop() ||
+                                     READ_ONCE(w->nr_jobs) > 0 || READ_ONCE(w->may_steal));
+         continue;
+      }
+
+      finish_job(job, READ_ONCE(job->client->closed) ? 0 : run_job(job));
+      STAT_INC(executed);
+      cond_resched();
+   }
+
+   return 0;
+}
+
+/**
+ * @brief Queue count jobs in the deque of the current CPU and wake up as
+ * many workers as needed to steal them
+ */
+static long pool_submit(struct pool_client * client, struct poolSubmit * req)
+{
+   struct pool_worker * w;
+   struct pool_job * job, * tmp;
+   LIST_HEAD(jobs);
+   unsigned int cpu, woken = 1;
+   u32 i;
+
+   if(req->count == 0 || req->count > POOL_MAX_JOBS || req->rounds > POOL_MAX_ROUNDS)
+      return -EINVAL;
+
+   // 1. Allocate all the jobs before queueing any of them
+   for(i = 0; i < req->count; i++)
+   {
+      job = kmalloc(sizeof(*job), GFP_KERNEL);
+      if(job == NULL)
+         goto Free;
+
+      job->client = client;
+      job->seed = req->seed + i;
+      job->rounds = req->rounds;
+      list_add_tail(&job->list, &jobs);
+   }
+
+   refcount_add(req->count, &client->refs);
+   atomic_add(req->count, &client->pending);
+
+   // 2. Push them to the local deque. If the submitter runs on a CPU that
+   // came online after loading the module, use any worker
+   cpu = raw_smp_processor_id();
+   if(!cpumask_test_cpu(cpu, &pool_cpus))
+      cpu = cpumask_first(&pool_cpus);
+   w = per_cpu_ptr(&workers, cpu);
+
+   spin_lock(&w->lock);
+   list_splice_tail(&jobs, &w->jobs);
+   w->nr_jobs += req->count;
+   spin_unlock(&w->lock);
+
+   STAT_ADD(submitted, req->count);
+
+   // 3. Wake up the owner, and one thief per extra job. The peers on the
+   // way are told that there is work to steal, even if they are not asleep
+   // yet, so that none goes to sleep after missing these jobs
+   wake_up(&w->wait);
+   for_each_cpu(cpu, &pool_cpus)
+   {
+      struct pool_worker * peer = per_cpu_ptr(&workers, cpu);
+
+      if(woken >= req->count)
+         break;
+      if(peer == w)
+         continue;
+
+      WRITE_ONCE(peer->may_steal, true);
+      if(wq_has_sleeper(&peer->wait))
+      {
+         wake_up(&peer->wait);
+         woken++;
+      }
+   }
+   return 0;
+
+Free:
+   list_for_each_entry_safe(job, tmp, &jobs, list)
+      kfree(job);
+   return -ENOMEM;
+}
+
+static long int driver_ioctl(struct file * file, unsigned cmd, unsigned long arg)
+{
+   struct pool_client * client = file->private_data;
+   struct poolSubmit req;
+   struct poolResult result;
+   int ret;
+
+   switch(cmd)
+   {
+      case POOL_SUBMIT:
+         if(copy_from_user(&req, (struct poolSubmit *) arg, sizeof(req)))
+            return -EFAULT;
+         return pool_submit(client, &req);
+
+      case POOL_WAIT:
+         ret = wait_event_interruptible(client->done, atomic_read(&client->pending) == 0);
+         if(ret)
+            return ret;
+
+         result.jobs = atomic64_xchg(&client->jobs, 0);
+         result.checksum = atomic64_xchg(&client->checksum, 0);
+         if(copy_to_user((struct poolResult *) arg, &result, sizeof(result)))
+            return -EFAULT;
+         return 0;
+
+      default:
+         return -ENOTTY;
    }
+}
+
+static int driver_open(struct inode * device_file, struct file * instance)
+{
+   struct pool_client * client = kzalloc(sizeof(*client), GFP_KERNEL);
+
+   if(client == NULL)
+      return -ENOMEM;
+
+   refcount_set(&client->refs, 1);
+   init_waitqueue_head(&client->done);
+   instance->private_data = client;
+   return 0;
+}
+
+/**
+ * @brief Closing the file doesn't wait for its jobs: the remaining ones are
+ * just dropped by the workers, and the last one frees the client
+ */
+static int driver_close(struct inode * device_file, struct file * instance)
+{
+   struct pool_client * client = instance->private_data;
 
-   printk("kthread - Thread %d finished execution!\n", t_nr);
+   WRITE_ONCE(client->closed, true);
+   client_put(client, 1);
    return 0;
 }
 
+static struct file_operations fops = {
+   .owner = THIS_MODULE,
+   .open = driver_open,
+   .release = driver_close,
+   .unlocked_ioctl = driver_ioctl
+};
+
+/**
+ * @brief Read a counter in /sys/kernel/kthread_pool/stats/, adding up
+ * the copies of all CPUs
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *)((char *)per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(submitted);
+STATS_ATTR(executed);
+STATS_ATTR(steals);
+STATS_ATTR(stolen_jobs);
+
+static struct attribute * stats_attrs[] = {
+   &submitted_attr.attr,
+   &executed_attr.attr,
+   &steals_attr.attr,
+   &stolen_jobs_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
+/**
+ * @brief Stop all the workers and drop the jobs left in their deques
+ */
+static void stop_workers(void)
+{
+   struct pool_job * job, * tmp;
+   unsigned int cpu;
+
+   for_each_cpu(cpu, &pool_cpus)
+      kthread_stop(per_cpu_ptr(&workers, cpu)->task);
+
+   for_each_cpu(cpu, &pool_cpus)
+   {
+      struct pool_worker * w = per_cpu_ptr(&workers, cpu);
+
+      list_for_each_entry_safe(job, tmp, &w->jobs, list)
+         finish_job(job, 0);
+   }
+   cpumask_clear(&pool_cpus);
+}
+
 static int __init myInit(void)
 {
+   unsigned int cpu;
+
    printk("kthread - Init threads\n");
 
-   // Start Thread 1:
+   // 1. Start one worker per online CPU, bound to it
+   for_each_online_cpu(cpu)
+   {
+      struct pool_worker * w = per_cpu_ptr(&workers, cpu);
+
+      spin_lock_init(&w->lock);
+      INIT_LIST_HEAD(&w->jobs);
+      init_waitqueue_head(&w->wait);
+      w->cpu = cpu;
 
-   kthread_1 = kthread_create(thread_function, &t1, "kthread_1");
-   if(kthread_1 != NULL)
+      w->task = kthread_create(worker_function, w, "kthread_pool/%u", cpu);
+      if(IS_ERR(w->task))
+      {
+         printk("kthread - Worker for CPU %u could not be created!\n", cpu);
+         goto ThreadError;
+      }
+
+      // A thread must be bound before it starts running
+      kthread_bind(w->task, cpu);
+      cpumask_set_cpu(cpu, &pool_cpus);
+      wake_up_process(w->task);
+   }
+   printk("kthread - %u workers are running now!\n", cpumask_weight(&pool_cpus));
+
+   // 2. Create /dev/kthread_pool to submit jobs
+   if(alloc_chrdev_region(&my_device_nr, 0, 1, DRIVER_NAME) < 0)
    {
-      // Start the thread:
-      wake_up_process(kthread_1);
-      printk("kthread - Thread 1 was created and it is running now!\n");
+      printk("kthread - Device Nr. could not be allocated!\n");
+      goto ThreadError;
    }
-   else
+
+   if((my_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL)
    {
-      printk("kthread - Thread 1 could not be created!\n");
-      return -1;
+      printk("kthread - Device class can not be created\n");
+      goto ClassError;
    }
 
-   // Start Thread 2:
-   // A different way of creating + launching threads:
-   kthread_2 = kthread_run(thread_function, &t2, "kthread_2");
-   if(kthread_2 != NULL)
+   if(device_create(my_class, NULL, my_device_nr, NULL, DRIVER_NAME) == NULL)
    {
-      printk("kthread - Thread 2 was created and it is running now!\n");
+      printk("kthread - Can not create device file\n");
+      goto FileError;
    }
-   else
+
+   cdev_init(&my_device, &fops);
+   if(cdev_add(&my_device, my_device_nr, 1) == -1)
    {
-      printk("kthread - Thread 2 could not be created!\n");
-      // Also stop thread 1
-      kthread_stop(kthread_1);
-      return -1;
+      printk("kthread - Registering of device to kernel failed!\n");
+      goto AddError;
+   }
+
+   // 3. Create /sys/kernel/kthread_pool/stats
+   stats_kobj = kobject_create_and_add("kthread_pool", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("kthread - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      goto StatsError;
    }
 
    return 0;
+
+StatsError:
+   cdev_del(&my_device);
+AddError:
+   device_destroy(my_class, my_device_nr);
+FileError:
+   class_destroy(my_class);
+ClassError:
+   unregister_chrdev_region(my_device_nr, 1);
+ThreadError:
+   stop_workers();
+   return -1;
 }
 
 static void __exit myExit(void)
 {
-   printk("kthread - Stopping both threads and exiting!\n");
-   kthread_stop(kthread_1);
-   kthread_stop(kthread_2);
+   printk("kthread - Stopping all the workers and exiting!\n");
+   kobject_put(stats_kobj);
+   cdev_del(&my_device);
+   device_destroy(my_class, my_device_nr);
+   class_destroy(my_class);
+   unregister_chrdev_region(my_device_nr, 1);
+   stop_workers();
    return;
 }
 
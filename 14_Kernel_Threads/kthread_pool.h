@@ -0,0 +1,31 @@
+#ifndef KTHREAD_POOL_H
+#define KTHREAD_POOL_H
+
+#include <linux/types.h>
+
+// Maximum amount of jobs in a single POOL_SUBMIT call
+#define POOL_MAX_JOBS 65536
+
+// Maximum amount of rounds of a single job
+#define POOL_MAX_ROUNDS (1 << 24)
+
+// Descriptor of the jobs passed to POOL_SUBMIT. Each job mixes its
+// seed with itself for the given amount of rounds, burning CPU time
+struct poolSubmit
+{
+    __u32 count;        // Amount of jobs
+    __u32 rounds;       // Rounds of every job
+    __u64 seed;         // Seed of the first job. Job i uses seed + i
+};
+
+// Result returned by POOL_WAIT
+struct poolResult
+{
+    __u64 jobs;         // Jobs completed since the last POOL_WAIT
+    __u64 checksum;     // Sum of the results of those jobs
+};
+
+#define POOL_SUBMIT _IOW('k', 'a', struct poolSubmit *)   // Queue the jobs and return
+#define POOL_WAIT   _IOR('k', 'b', struct poolResult *)   // Block until all the jobs of this file are done
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+#include "kthread_pool.h"
+
+// Same work as run_job() in kthread.c, to check the results of the pool
+static uint64_t run_job(uint64_t seed, uint32_t rounds)
+{
+    uint64_t x = seed, sum = 0;
+
+    for (uint32_t i = 0; i < rounds; i++)
+    {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        sum += z ^ (z >> 31);
+    }
+    return sum;
+}
+
+int main(int argc, char * argv[])
+{
+    struct poolSubmit req = {
+        .count = argc > 1 ? atoi(argv[1]) : 10000,
+        .rounds = argc > 2 ? atoi(argv[2]) : 100000,
+        .seed = 1
+    };
+    struct poolResult result;
+    struct timespec start, end;
+    uint64_t expected = 0;
+
+    int dev = open("/dev/kthread_pool", O_RDWR);
+    if (dev == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    // Submit all the jobs at once and wait until the pool has run them
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ioctl(dev, POOL_SUBMIT, &req) < 0)
+    {
+        perror("POOL_SUBMIT failed");
+        close(dev);
+        return -1;
+    }
+    if (ioctl(dev, POOL_WAIT, &result) < 0)
+    {
+        perror("POOL_WAIT failed");
+        close(dev);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%llu jobs of %u rounds in %.3f s: %.0f jobs/s\n",
+           (unsigned long long) result.jobs, req.rounds, seconds, result.jobs / seconds);
+
+    // Check the checksum against the same work done here
+    for (uint32_t i = 0; i < req.count; i++)
+    {
+        expected += run_job(req.seed + i, req.rounds);
+    }
+    printf("Checksum %s\n", expected == result.checksum ? "OK" : "WRONG");
+
+    close(dev);
+    return expected == result.checksum ? 0 : -1;
+}
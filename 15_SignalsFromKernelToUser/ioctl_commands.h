@@ -1,10 +1,26 @@
 #ifndef SIGNALS_TEST_H
 #define SIGNALS_TEST_H
 
+#include <linux/types.h>
+
+// Periodic signals: one every period_ns nanoseconds, at the times where
+// CLOCK_MONOTONIC modulo period_ns equals phase_ns. A period of 0 stops them
+struct tickConfig
+{
+    __u64 period_ns;
+    __u64 phase_ns;     // Must be lower than period_ns
+};
+
+// Shortest period accepted by SET_TICK
+#define MIN_TICK_NS 10000
+
 // The kernel will generate a unique magic number for the command
 #define REGISTER_UAPP _IO('R', 'g')
+#define SEND_SIGNAL   _IO('R', 's')     // Send one signal to the registered app now
+#define SET_TICK      _IOW('R', 't', struct tickConfig *)
+#define REGISTER_EVENTFD _IO('R', 'e')     // Notify through the eventfd passed as argument, instead of a signal
 
 // Signal sending parameters
 #define SIGNR 44
 
-#endif
\ No newline at end of file
+#endif
@@ -2,14 +2,29 @@
 #include <linux/init.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
-#include <linux/delay.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/sched/task.h>
+#include <linux/eventfd.h>
 
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/sched/signal.h>     // For signal sending
 #include <linux/ioctl.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
 
 #include "ioctl_commands.h"
+#include "../18_Procfs/latency_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "signals_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
@@ -17,63 +32,336 @@ MODULE_DESCRIPTION("A simple example for sending signals from a LKM to user spac
 
 // Global variables for the threads:
 static struct task_struct * kthread_1;
-static int sleep_time = 5;
 
-// Global variables and defines for userspace app registration
-static struct task_struct * task = NULL;
+// Default period of the signals sent to the registered app, in microseconds.
+// With 0, signals are only sent on request (SEND_SIGNAL) until SET_TICK is used
+static unsigned int period_us = 5000000;
+module_param(period_us, uint, 0444);
+MODULE_PARM_DESC(period_us, "Period of the signals in us, 0 to only send them on request");
+
+// The thread sleeps until there are signals to send
+static DECLARE_WAIT_QUEUE_HEAD(thread_wait);
+static atomic_t pending_signals = ATOMIC_INIT(0);
+
+// Tick engine: an hrtimer sending the periodic signals. The settings
+// are only changed with the timer stopped, under config_lock
+static struct hrtimer tick_timer;
+static DEFINE_MUTEX(config_lock);
+static u64 tick_period_ns;
+static u64 tick_phase_ns;
+
+/**
+ * An app registered with REGISTER_UAPP or REGISTER_EVENTFD. The list is only
+ * modified under config_lock, and it is walked under rcu_read_lock() by the
+ * tick timer and the thread, so notifying the apps never waits for a lock
+ */
+struct subscriber {
+   struct list_head list;
+   struct file * file;           // File used to register. Closing it unregisters the app
+   struct task_struct * task;    // App to signal, or NULL. A reference is held while registered
+   struct eventfd_ctx * eventfd; // Or eventfd to increment, also referenced
+   struct rcu_head rcu;
+};
+
+static LIST_HEAD(subscribers);
 
 #define MY_MAJOR 91     // Free device number. Check list in cat /proc/devices
 
+/**
+ * Counters kept per CPU, so updating them needs no atomics.
+ * Read as totals from /sys/kernel/signals/stats/
+ */
+struct driver_stats {
+   u64 ioctls;
+   u64 signals_sent;
+   u64 errors;          // Signals that could not be delivered
+   u64 ticks;           // Expirations of the tick timer
+   u64 overruns;        // Periods missed by the tick timer
+   u64 events;          // Notifications sent through an eventfd
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Latency of my_ioctl, shown in /proc/hello/latency when the procfs
+// module (exercise 18) is loaded
+static struct latency_hist ioctl_hist;
+
 
 void send_signal(struct task_struct * task)
 {
    struct siginfo info;
+   u64 start = trace_signals_send_enabled() ? ktime_get_ns() : 0;
+   int ret;
+
    memset(&info, 0, sizeof(info));
 
    info.si_signo = SIGNR;
    info.si_code = SI_QUEUE;
 
-   if(send_sig_info(SIGNR, (struct kernel_siginfo *)&info, task) < 0)
+   // Errors are reported by the tracepoint, to keep the loop quiet
+   ret = send_sig_info(SIGNR, (struct kernel_siginfo *)&info, task);
+   if(start)
+      trace_signals_send(task->pid, ret, ktime_get_ns() - start);
+
+   if(ret < 0)
+      STAT_INC(errors);
+   else
+      STAT_INC(signals_sent);
+}
+
+/**
+ * @brief Notify every registered app, with a signal or through its eventfd
+ */
+static void notify_subscribers(void)
+{
+   struct subscriber * sub;
+
+   rcu_read_lock();
+   list_for_each_entry_rcu(sub, &subscribers, list)
    {
-      printk("signals - error sending signal\n");
+      if(sub->eventfd != NULL)
+      {
+         eventfd_signal(sub->eventfd, 1);
+         STAT_INC(events);
+      }
+      else
+      {
+         send_signal(sub->task);
+      }
    }
+   rcu_read_unlock();
+}
+
+/**
+ * @brief Queue one signal and wake up the thread to send it
+ */
+static void queue_signal(void)
+{
+   atomic_inc(&pending_signals);
+   wake_up(&thread_wait);
+}
+
+/**
+ * @brief Tick timer. The signal is sent right from the callback, with no
+ * thread wake up in between. If the callback runs so late that whole periods
+ * have passed, hrtimer_forward_now() skips them and they count as overruns
+ */
+static enum hrtimer_restart tick_function(struct hrtimer * timer)
+{
+   u64 periods = hrtimer_forward_now(timer, ns_to_ktime(tick_period_ns));
+
+   STAT_INC(ticks);
+   if(periods > 1)
+      STAT_ADD(overruns, periods - 1);
+
+   notify_subscribers();
+   return HRTIMER_RESTART;
+}
+
+/**
+ * @brief Start the tick timer at the first time aligned to period and
+ * phase. Called with config_lock held and the timer stopped
+ */
+static void tick_start(void)
+{
+   u64 now, first;
+
+   if(tick_period_ns == 0 || list_empty(&subscribers))
+      return;
+
+   now = ktime_get_ns();
+   first = tick_phase_ns;
+   if(now > first)
+      first += div64_u64(now - first + tick_period_ns - 1, tick_period_ns) * tick_period_ns;
+
+   hrtimer_start(&tick_timer, ns_to_ktime(first), HRTIMER_MODE_ABS);
+}
+
+/**
+ * @brief Apply a new tick configuration
+ */
+static long set_tick(struct tickConfig __user * arg)
+{
+   struct tickConfig config;
+
+   if(copy_from_user(&config, arg, sizeof(config)))
+      return -EFAULT;
+
+   if(config.period_ns != 0 && (config.period_ns < MIN_TICK_NS || config.phase_ns >= config.period_ns))
+      return -EINVAL;
+
+   mutex_lock(&config_lock);
+   hrtimer_cancel(&tick_timer);
+   tick_period_ns = config.period_ns;
+   tick_phase_ns = config.phase_ns;
+   tick_start();
+   mutex_unlock(&config_lock);
+
+   return 0;
 }
 
 // Function that will be executed by the thread
 // Args must be passed as void pointers
 int thread_function(void * data)
 {
-   int sleep_time_secs = *(int *)data;
-
-   // Do something with the counter and print it
-   printk("signals - Thread function! Sending signal in %d seconds...\n", sleep_time_secs);
+   int n;
 
    // Working loop:
    while(!kthread_should_stop())
    {
-      // Delay time depending on thread number
-      msleep(sleep_time_secs * 1000);
+      // Sleep until there is something to send. Nothing wakes the thread
+      // up while there are no signals queued
+      wait_event_interruptible(thread_wait, kthread_should_stop() || atomic_read(&pending_signals) > 0);
 
-      // Send the signal
-      if (task != NULL)
-      {
-         send_signal(task);
-      }
+      // Send all the queued signals. SIGNR is a real-time signal, so
+      // they are not merged if several are pending
+      for(n = atomic_xchg(&pending_signals, 0); n > 0; n--)
+         notify_subscribers();
    }
 
    printk("signals - Thread finished execution!\n");
    return 0;
 }
 
+/**
+ * @brief Look for the subscriber registered through a file. Called with
+ * config_lock held
+ */
+static struct subscriber * find_subscriber(struct file * file)
+{
+   struct subscriber * sub;
+
+   list_for_each_entry(sub, &subscribers, list)
+   {
+      if(sub->file == file)
+         return sub;
+   }
+   return NULL;
+}
+
+/**
+ * @brief Drop the references of a subscriber and free it
+ */
+static void free_subscriber(struct rcu_head * rcu)
+{
+   struct subscriber * sub = container_of(rcu, struct subscriber, rcu);
+
+   if(sub->eventfd != NULL)
+      eventfd_ctx_put(sub->eventfd);
+   else
+      put_task_struct(sub->task);
+   kfree(sub);
+}
+
+/**
+ * @brief Register the calling app, to be signalled or, if eventfd is not
+ * NULL, notified through it. A file can only be used to register once
+ */
+static long subscribe(struct file * file, struct eventfd_ctx * eventfd)
+{
+   struct subscriber * sub = kmalloc(sizeof(*sub), GFP_KERNEL);
+
+   if(sub == NULL)
+   {
+      if(eventfd != NULL)
+         eventfd_ctx_put(eventfd);
+      return -ENOMEM;
+   }
+
+   sub->file = file;
+   sub->eventfd = eventfd;
+   sub->task = eventfd ? NULL : get_task_struct(current);
+
+   mutex_lock(&config_lock);
+   if(find_subscriber(file) != NULL)
+   {
+      mutex_unlock(&config_lock);
+      free_subscriber(&sub->rcu);
+      return -EBUSY;
+   }
+
+   list_add_tail_rcu(&sub->list, &subscribers);
+
+   // Start sending periodic signals with the first app
+   if(list_is_singular(&subscribers))
+      tick_start();
+   mutex_unlock(&config_lock);
+
+   return 0;
+}
+
+/**
+ * @brief Unregister the app registered through a file, if any. It is freed
+ * once no reader can be walking past it
+ */
+static void unsubscribe(struct file * file)
+{
+   struct subscriber * sub;
+
+   mutex_lock(&config_lock);
+   sub = find_subscriber(file);
+   if(sub != NULL)
+   {
+      list_del_rcu(&sub->list);
+      if(list_empty(&subscribers))
+         hrtimer_cancel(&tick_timer);
+   }
+   mutex_unlock(&config_lock);
+
+   if(sub != NULL)
+      call_rcu(&sub->rcu, free_subscriber);
+}
+
 // IOCTL function for registering the UserSpace app to the kernel module 
 static long int my_ioctl(struct file * file, unsigned cmd, unsigned long arg) 
 {
-   if (cmd == REGISTER_UAPP)
+   u64 start = ktime_get_ns();
+   u64 latency;
+   long ret = 0;
+
+   switch(cmd)
    {
-      task = get_current();
-      printk("signals - Userspace app with PID %d is registered\n", task->pid);
+      case REGISTER_UAPP:
+         ret = subscribe(file, NULL);
+         break;
+
+      case REGISTER_EVENTFD:
+      {
+         struct eventfd_ctx * eventfd = eventfd_ctx_fdget((int) arg);
+
+         if(IS_ERR(eventfd))
+            ret = PTR_ERR(eventfd);
+         else
+            ret = subscribe(file, eventfd);
+         break;
+      }
+
+      case SET_TICK:
+         ret = set_tick((struct tickConfig __user *) arg);
+         break;
+
+      case SEND_SIGNAL:
+         if(list_empty(&subscribers))
+            ret = -ENODEV;
+         else
+            queue_signal();
+         break;
+
+      default:
+         ret = -ENOTTY;
+         break;
    }
-   return 0;
+
+   latency = ktime_get_ns() - start;
+   latency_hist_record(&ioctl_hist, latency);
+   trace_signals_ioctl(cmd, current->pid, ret, latency);
+   STAT_INC(ioctls);
+   return ret;
 }
 
 /**
@@ -81,16 +369,55 @@ static long int my_ioctl(struct file * file, unsigned cmd, unsigned long arg)
  */
 static int my_close(struct inode * device_file, struct file * instance) 
 {
-   printk("signals - close was called!\n");
-   if (task != NULL)
-   {
-      task = NULL;
-   }
+   trace_signals_release(iminor(device_file));
+   unsubscribe(instance);
    return 0;
 }
 
 
 
+/**
+ * @brief Sum of one counter over all the CPUs
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(ioctls);
+STATS_ATTR(signals_sent);
+STATS_ATTR(errors);
+STATS_ATTR(ticks);
+STATS_ATTR(overruns);
+STATS_ATTR(events);
+
+static struct attribute * stats_attrs[] = {
+   &ioctls_attr.attr,
+   &signals_sent_attr.attr,
+   &errors_attr.attr,
+   &ticks_attr.attr,
+   &overruns_attr.attr,
+   &events_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
 static struct file_operations fops = {
    .owner = THIS_MODULE,
    .release = my_close,
@@ -99,8 +426,21 @@ static struct file_operations fops = {
 
 static int __init myInit(void)
 {
+   int retVal;
+
+   if(latency_hist_init(&ioctl_hist, "signals_ioctl"))
+   {
+      printk("signals - Latency histogram could not be allocated!\n");
+      return -ENOMEM;
+   }
+
+   // The ioctls start the timer, so it is ready before the device is registered
+   hrtimer_init(&tick_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+   tick_timer.function = tick_function;
+   tick_period_ns = (u64) period_us * NSEC_PER_USEC;
+
    // Register the device number for a new character device
-   int retVal = register_chrdev(MY_MAJOR, "LKM_signals", &fops);
+   retVal = register_chrdev(MY_MAJOR, "LKM_signals", &fops);
 
    // retval contains some info encoded.
 
@@ -121,15 +461,28 @@ static int __init myInit(void)
    else
    {
       printk("signals - Could not register device number!\n");
+      latency_hist_free(&ioctl_hist);
       return -1;
    }
 
+   // Create /sys/kernel/signals/stats
+   stats_kobj = kobject_create_and_add("signals", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("signals - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      unregister_chrdev(MY_MAJOR, "LKM_signals");
+      hrtimer_cancel(&tick_timer);
+      latency_hist_free(&ioctl_hist);
+      return -ENOMEM;
+   }
+
    printk("signals - Init threads\n");
 
    // Start Thread 1:
 
-   kthread_1 = kthread_create(thread_function, &sleep_time, "kthread_1");
-   if(kthread_1 != NULL)
+   kthread_1 = kthread_create(thread_function, NULL, "kthread_1");
+   if(!IS_ERR(kthread_1))
    {
       // Start the thread:
       wake_up_process(kthread_1);
@@ -138,20 +491,31 @@ static int __init myInit(void)
    else
    {
       printk("signals - Thread could not be created!\n");
+      kthread_1 = NULL;
+      kobject_put(stats_kobj);
+      unregister_chrdev(MY_MAJOR, "LKM_signals");
+      hrtimer_cancel(&tick_timer);
+      latency_hist_free(&ioctl_hist);
       return -1;
    }
 
+   latency_hist_publish(&ioctl_hist);
    return 0;
 }
 
 static void __exit myExit(void)
 {
    printk("signals - Stopping thread and exiting!\n");
+   latency_hist_unpublish(&ioctl_hist);
+   hrtimer_cancel(&tick_timer);
    if(kthread_1 != NULL)
    {
       kthread_stop(kthread_1);
    }
+   kobject_put(stats_kobj);
    unregister_chrdev(MY_MAJOR, "LKM_signals");
+   rcu_barrier();    // Wait for the subscribers still being freed
+   latency_hist_free(&ioctl_hist);
    return;
 }
 
@@ -0,0 +1,65 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM signals
+
+#if !defined(_SIGNALS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SIGNALS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Enable with: echo 1 > /sys/kernel/tracing/events/signals/enable
+
+TRACE_EVENT(signals_release,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+   ),
+   TP_printk("minor=%u", __entry->minor)
+);
+
+TRACE_EVENT(signals_ioctl,
+   TP_PROTO(unsigned int cmd, pid_t pid, long ret, u64 latency_ns),
+   TP_ARGS(cmd, pid, ret, latency_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, cmd)
+      __field(pid_t, pid)
+      __field(long, ret)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->cmd = cmd;
+      __entry->pid = pid;
+      __entry->ret = ret;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("cmd=0x%x pid=%d ret=%ld latency_ns=%llu",
+      __entry->cmd, __entry->pid, __entry->ret, __entry->latency_ns)
+);
+
+// A signal sent to a registered app: its result and how long it took
+TRACE_EVENT(signals_send,
+   TP_PROTO(pid_t pid, int ret, u64 latency_ns),
+   TP_ARGS(pid, ret, latency_ns),
+   TP_STRUCT__entry(
+      __field(pid_t, pid)
+      __field(int, ret)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->pid = pid;
+      __entry->ret = ret;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("pid=%d ret=%d latency_ns=%llu", __entry->pid, __entry->ret, __entry->latency_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE signals_trace
+#include <trace/define_trace.h>
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>      // To allow issuing ioctl commands
 #include <signal.h>
+#include <string.h>
 
 #include "ioctl_commands.h"
 
@@ -15,7 +16,7 @@ void signalHandler(int sig)
     signal_received = 1;
 }
 
-int main()
+int main(int argc, char * argv[])
 {
     int fd;
 
@@ -40,6 +41,12 @@ int main()
         return -1;
     }
 
+    // With "now", ask for a signal instead of waiting for the periodic one
+    if(argc > 1 && strcmp(argv[1], "now") == 0)
+    {
+        ioctl(fd, SEND_SIGNAL, NULL);
+    }
+
     printf("Waiting for signal... \n");
     while(!signal_received)
     {
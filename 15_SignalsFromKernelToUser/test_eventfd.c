@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include "ioctl_commands.h"
+
+int main(int argc, char * argv[])
+{
+    struct epoll_event event = { .events = EPOLLIN };
+    int wakeups = argc > 1 ? atoi(argv[1]) : 5;
+    uint64_t count;
+
+    // Open the device file
+    int fd = open("/dev/signals", O_WRONLY);
+    if (fd == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    // Create the eventfd and hand it to the module
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1 || ioctl(fd, REGISTER_EVENTFD, efd) < 0)
+    {
+        perror("Error registering the eventfd");
+        close(fd);
+        return -1;
+    }
+
+    // The eventfd can be waited for in an epoll loop, together with
+    // sockets, pipes or any other file descriptor
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    event.data.fd = efd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &event);
+
+    for (int i = 0; i < wakeups; i++)
+    {
+        if (epoll_wait(epfd, &event, 1, -1) != 1)
+        {
+            perror("epoll_wait failed");
+            break;
+        }
+
+        // A single read returns all the notifications since the last one
+        if (read(efd, &count, sizeof(count)) == sizeof(count))
+        {
+            printf("Woken up: %llu notifications\n", (unsigned long long) count);
+        }
+
+        // Simulate a busy consumer, to see several notifications merged
+        usleep(100000);
+    }
+
+    close(epfd);
+    close(efd);
+    close(fd);
+    return 0;
+}
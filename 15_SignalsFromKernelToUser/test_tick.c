@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+#include <signal.h>
+
+#include "ioctl_commands.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char * argv[])
+{
+    struct tickConfig config = {
+        .period_ns = (argc > 1 ? atoll(argv[1]) : 1000) * 1000ULL,   // Period in us
+        .phase_ns = 0
+    };
+    int seconds = argc > 2 ? atoi(argv[2]) : 1;
+    struct timespec timeout = {1, 0};
+    uint64_t end, late, max_late = 0, sum_late = 0, count = 0;
+    sigset_t set;
+
+    // Block the signal and take it with sigtimedwait(), so that there is
+    // no handler and the time of every tick can be measured
+    sigemptyset(&set);
+    sigaddset(&set, SIGNR);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    int fd = open("/dev/signals", O_WRONLY);
+    if (fd == -1)
+    {
+        printf("Opening was not possible\n");
+        return -1;
+    }
+
+    if (ioctl(fd, REGISTER_UAPP, NULL) < 0 || ioctl(fd, SET_TICK, &config) < 0)
+    {
+        perror("Error configuring the ticks");
+        close(fd);
+        return -1;
+    }
+
+    // The ticks are aligned to multiples of the period (phase 0), so the
+    // lateness of every signal is the time elapsed since the last multiple
+    end = now_ns() + seconds * 1000000000ULL;
+    while (now_ns() < end)
+    {
+        if (sigtimedwait(&set, NULL, &timeout) != SIGNR)
+        {
+            continue;
+        }
+        late = now_ns() % config.period_ns;
+        sum_late += late;
+        if (late > max_late)
+        {
+            max_late = late;
+        }
+        count++;
+    }
+
+    printf("%llu ticks in %d s (expected %llu), latency avg %llu ns, max %llu ns\n",
+           (unsigned long long) count, seconds,
+           (unsigned long long) (seconds * 1000000000ULL / config.period_ns),
+           (unsigned long long) (count ? sum_late / count : 0),
+           (unsigned long long) max_late);
+    printf("Missed periods: see /sys/kernel/signals/stats/overruns\n");
+
+    close(fd);
+    return 0;
+}
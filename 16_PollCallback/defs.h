@@ -1,9 +1,36 @@
 #ifndef POLL_TEST_H
 #define POLL_TEST_H
 
+#include <linux/types.h>
+
 // The kernel will generate a unique magic number for the command
-#define CMD_UNLOCK _IO('R', 'g')
+#define CMD_UNLOCK _IO('R', 'g')                // Post one event
+#define CMD_POST   _IO('R', 'p')                // Post the amount of events passed as argument
+#define CMD_SET_MODE _IO('R', 'm')            // Choose how this file gets its events (POLL_MODE_*)
+
+// Every waiter competes for every event. A blocking read() or an epoll
+// with EPOLLEXCLUSIVE only wakes up one waiter per event
+#define POLL_MODE_SHARED 0
+// Events are assigned to the files in this mode in turn and moved to
+// their own queues. Only the file receiving an event is woken up
+#define POLL_MODE_ROUND_ROBIN 1
 
 #define DEVICE_FILE_NAME "/dev/poll"
 
-#endif
\ No newline at end of file
+// Record returned by read() for every event. A read returns as many
+// records as fit in the buffer
+struct pollEvent
+{
+    __u64 timestamp_ns;     // CLOCK_MONOTONIC time when the event was posted
+    __u32 seq;              // Sequence number of the event, starting at 1
+    __s32 pid;              // Process that posted it
+};
+
+// Capacity of the shared event queue, and of the queue of every file in
+// POLL_MODE_ROUND_ROBIN. Events posted while they are full are dropped
+#define EVENT_QUEUE_SIZE 4096
+
+// Maximum amount of events posted by a single CMD_POST
+#define MAX_POST EVENT_QUEUE_SIZE
+
+#endif
@@ -7,40 +7,410 @@
 
 #include <linux/poll.h>
 #include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
 
 #include "defs.h"
+#include "../18_Procfs/latency_hist.h"
+
+#define CREATE_TRACE_POINTS
+#include "pollCallback_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("A simple example for sending poll from a LKM to user space");
 
 
-static int irq_ready = 0;
-static wait_queue_head_t waitqueue;
+/*
+ * Event queues. Every posted event is stored as a record, so none is lost if
+ * several arrive before the pollers run. Producers are serialized by
+ * post_lock, and readers by read_lock, which can be held while copying to
+ * user space. A kfifo needs no lock between its single producer and its
+ * single consumer
+ */
+typedef STRUCT_KFIFO_PTR(struct pollEvent) event_fifo;
+
+static struct pollEvent events_buf[EVENT_QUEUE_SIZE];
+static event_fifo events;  // Shared queue, used while there are no round-robin clients
+static DEFINE_SPINLOCK(post_lock);
+static DEFINE_MUTEX(read_lock);
+static u32 event_seq;      // Protected by post_lock
+
+static wait_queue_head_t waitqueue;       // Waiters in POLL_MODE_SHARED
+
+/**
+ * State of every open file. In POLL_MODE_ROUND_ROBIN, the file is in
+ * rr_clients and the events assigned to it are moved to its own queue, so
+ * no other file can read them. Only its own wait queue is woken up for them
+ */
+struct poll_client {
+   struct list_head list;        // Entry in rr_clients, protected by post_lock
+   wait_queue_head_t wait;
+   u32 mode;
+   event_fifo queue;             // Allocated when the file first joins rr_clients
+   u32 wake_gen;                 // Last post_events() call that woke it up
+};
+
+static LIST_HEAD(rr_clients);
+static u32 post_gen;       // Calls to post_events(), protected by post_lock
 
 #define MY_MAJOR 91     // Free device number. Check list in cat /proc/devices
 
+/**
+ * Per-CPU counters, shown as totals in /sys/kernel/poll_callback/stats/
+ */
+struct driver_stats {
+   u64 ioctls;
+   u64 polls;           // Calls to my_poll
+   u64 ready;           // Calls to my_poll that reported POLLIN
+   u64 wakeups;         // Wake ups issued by CMD_UNLOCK and CMD_POST
+   u64 events;          // Events queued
+   u64 dropped;         // Events lost because the queue was full
+   u64 events_read;     // Events returned by read()
+};
+
+static DEFINE_PER_CPU(struct driver_stats, stats);
+
+#define STAT_ADD(field, n) this_cpu_add(stats.field, (n))
+#define STAT_INC(field) this_cpu_inc(stats.field)
+
+static struct kobject * stats_kobj;
+
+// Latency of my_ioctl, shown in /proc/hello/latency when the procfs
+// module (exercise 18) is loaded
+static struct latency_hist ioctl_hist;
+
+/**
+ * @brief Queue an event in the next round-robin client with room for it, and
+ * wake the client up if it was not yet in this call. Returns false if the
+ * queues of all the clients are full. Called with post_lock held
+ */
+static bool assign_event(const struct pollEvent * event)
+{
+   struct poll_client * first = list_first_entry(&rr_clients, struct poll_client, list);
+   struct poll_client * client;
+
+   do
+   {
+      client = list_first_entry(&rr_clients, struct poll_client, list);
+      list_rotate_left(&rr_clients);
+      if(kfifo_put(&client->queue, *event))
+      {
+         if(client->wake_gen != post_gen)
+         {
+            client->wake_gen = post_gen;
+            wake_up_poll(&client->wait, EPOLLIN | EPOLLRDNORM);
+            STAT_INC(wakeups);
+         }
+         return true;
+      }
+   } while(list_first_entry(&rr_clients, struct poll_client, list) != first);
+
+   return false;
+}
+
+/**
+ * @brief Hand the events left in the queue of a client leaving the
+ * round-robin clients to the remaining ones. If it was the last one, they go
+ * back to the shared queue. Called with read_lock and post_lock held, once
+ * the client is out of rr_clients
+ */
+static void release_assigned(struct poll_client * client)
+{
+   bool shared = list_empty(&rr_clients);
+   struct pollEvent event;
+   unsigned int moved = 0;
+
+   post_gen++;
+   while(kfifo_get(&client->queue, &event))
+   {
+      if(shared ? kfifo_put(&events, event) : assign_event(&event))
+         moved++;
+      else
+         STAT_INC(dropped);
+   }
+
+   if(shared && moved > 0)
+   {
+      __wake_up(&waitqueue, TASK_NORMAL, moved, poll_to_key(EPOLLIN | EPOLLRDNORM));
+      STAT_INC(wakeups);
+   }
+}
+
+/**
+ * @brief Queue count events and wake up the waiting processes: one
+ * exclusive waiter per event, or the round-robin clients that got
+ * any of them. Returns the amount of events queued
+ */
+static unsigned int post_events(unsigned int count)
+{
+   struct pollEvent event = {
+      .timestamp_ns = ktime_get_ns(),
+      .pid = task_tgid_vnr(current)
+   };
+   unsigned long flags;
+   unsigned int i;
+   bool shared;
+
+   spin_lock_irqsave(&post_lock, flags);
+   post_gen++;
+   shared = list_empty(&rr_clients);
+   for(i = 0; i < count; i++)
+   {
+      event.seq = event_seq + 1;
+      if(shared ? !kfifo_put(&events, event) : !assign_event(&event))
+         break;
+      event_seq++;
+   }
+   spin_unlock_irqrestore(&post_lock, flags);
+
+   STAT_ADD(events, i);
+   if(i < count)
+      STAT_ADD(dropped, count - i);
+
+   // Wakes up all the non-exclusive waiters (plain poll/select), but only
+   // i of the exclusive ones, so there is no thundering herd among them.
+   // The key tells epoll and io_uring which events happened
+   if(shared && i > 0)
+   {
+      __wake_up(&waitqueue, TASK_NORMAL, i, poll_to_key(EPOLLIN | EPOLLRDNORM));
+      STAT_INC(wakeups);
+   }
+   return i;
+}
+
+/**
+ * @brief Queue the file reads its events from
+ */
+static event_fifo * client_queue(struct poll_client * client)
+{
+   return READ_ONCE(client->mode) == POLL_MODE_ROUND_ROBIN ? &client->queue : &events;
+}
+
+/**
+ * @brief Whether the file has events to read
+ */
+static bool client_ready(struct poll_client * client)
+{
+   return !kfifo_is_empty(client_queue(client));
+}
+
+static wait_queue_head_t * client_waitqueue(struct poll_client * client)
+{
+   return client->mode == POLL_MODE_ROUND_ROBIN ? &client->wait : &waitqueue;
+}
+
 // Poll callback:
 static unsigned int my_poll(struct file * file, poll_table * wait)
 {
-   poll_wait(file, &waitqueue, wait);  // Won't take CPU resources while waiting
-   if (irq_ready == 1)
+   struct poll_client * client = file->private_data;
+   unsigned int mask = 0;
+
+   poll_wait(file, client_waitqueue(client), wait);  // Won't take CPU resources while waiting
+
+   // Readable while there are events for this file. They are only removed by read()
+   if (client_ready(client))
    {
-      irq_ready = 0;
-      return POLLIN;
+      mask = POLLIN | POLLRDNORM;
    }
+
+   trace_poll_callback_poll(mask);
+
+   STAT_INC(polls);
+   if(mask)
+      STAT_INC(ready);
+   return mask;
+}
+
+/**
+ * @brief Move up to max events from the queue to the iterator. An event is
+ * only removed from the queue once it has been copied, so a bad buffer
+ * doesn't lose any. Called with read_lock held. Returns the amount of events
+ * copied, or -EFAULT if none could be
+ */
+static ssize_t events_to_iter(event_fifo * queue, struct iov_iter * to, size_t max)
+{
+   struct pollEvent chunk[16];
+   size_t copied = 0;
+   unsigned int n, done;
+
+   while(copied < max)
+   {
+      n = kfifo_out_peek(queue, chunk, min_t(size_t, max - copied, ARRAY_SIZE(chunk)));
+      if(n == 0)
+         break;
+
+      done = copy_to_iter(chunk, n * sizeof(chunk[0]), to) / sizeof(chunk[0]);
+      kfifo_out(queue, chunk, done);     // Drop the events just copied
+      copied += done;
+
+      if(done < n)
+         return copied ? copied : -EFAULT;
+   }
+   return copied;
+}
+
+/**
+ * @brief Read as many events as fit in the buffer. Blocks until there is at
+ * least one, unless the file was opened with O_NONBLOCK or the caller asks
+ * not to wait (IOCB_NOWAIT), as io_uring does on its first attempt. In that
+ * case io_uring gets -EAGAIN, waits through my_poll() and tries again when
+ * an event is posted, with no extra system call from user space
+ */
+static ssize_t my_read_iter(struct kiocb * iocb, struct iov_iter * to)
+{
+   struct poll_client * client = iocb->ki_filp->private_data;
+   bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+   size_t room = iov_iter_count(to) / sizeof(struct pollEvent);
+   ssize_t copied;
+
+   if(room == 0)
+      return -EINVAL;
+
+   for(;;)
+   {
+      // With IOCB_NOWAIT, not even the mutex can be waited for
+      if(iocb->ki_flags & IOCB_NOWAIT)
+      {
+         if(!mutex_trylock(&read_lock))
+            return -EAGAIN;
+      }
+      else if(mutex_lock_interruptible(&read_lock))
+      {
+         return -ERESTARTSYS;
+      }
+
+      if(!client_ready(client))
+      {
+         mutex_unlock(&read_lock);
+         if(nowait)
+            return -EAGAIN;
+
+         // Exclusive wait: each event wakes up a single blocked reader
+         if(wait_event_interruptible_exclusive(*client_waitqueue(client), client_ready(client)))
+            return -ERESTARTSYS;
+         continue;
+      }
+
+      // A round-robin client only takes the events in its own queue
+      copied = events_to_iter(client_queue(client), to, room);
+      mutex_unlock(&read_lock);
+
+      // Never return 0, which means end of file: if another reader took the
+      // events first, wait for the next ones
+      if(copied != 0)
+         break;
+   }
+   if(copied < 0)
+      return copied;
+
+   STAT_ADD(events_read, copied);
+   return copied * sizeof(struct pollEvent);
+}
+
+/**
+ * @brief Join or leave the round-robin clients
+ */
+static long set_mode(struct poll_client * client, unsigned long mode)
+{
+   unsigned long flags;
+
+   if(mode != POLL_MODE_SHARED && mode != POLL_MODE_ROUND_ROBIN)
+      return -EINVAL;
+
+   // Hold read_lock too, so that no read of this client is in progress
+   mutex_lock(&read_lock);
+
+   // The queue is kept until the file is closed, as my_poll() may be using it
+   if(mode == POLL_MODE_ROUND_ROBIN && !kfifo_initialized(&client->queue) &&
+      kfifo_alloc(&client->queue, EVENT_QUEUE_SIZE, GFP_KERNEL))
+   {
+      mutex_unlock(&read_lock);
+      return -ENOMEM;
+   }
+
+   spin_lock_irqsave(&post_lock, flags);
+   if(mode != client->mode)
+   {
+      if(mode == POLL_MODE_ROUND_ROBIN)
+      {
+         list_add_tail(&client->list, &rr_clients);
+      }
+      else
+      {
+         list_del_init(&client->list);
+         release_assigned(client);
+      }
+      WRITE_ONCE(client->mode, mode);
+   }
+   spin_unlock_irqrestore(&post_lock, flags);
+   mutex_unlock(&read_lock);
+
    return 0;
 }
 
 // IOCTL function for unocking the UserSpace app from the wait induced by polling
 static long int my_ioctl(struct file * file, unsigned cmd, unsigned long arg) 
 {
-   if (cmd == CMD_UNLOCK)
+   u64 start = ktime_get_ns();
+   u64 latency;
+   long ret = 0;
+
+   switch(cmd)
    {
-      printk("poll - Waking up polling processes\n");
-      irq_ready = 1;
-      wake_up(&waitqueue);
+      case CMD_UNLOCK:
+         if(post_events(1) == 0)
+            ret = -ENOSPC;
+         break;
+
+      case CMD_POST:
+         if(arg == 0 || arg > MAX_POST)
+            ret = -EINVAL;
+         else
+            ret = post_events(arg);     // Amount of events queued
+         break;
+
+      case CMD_SET_MODE:
+         ret = set_mode(file->private_data, arg);
+         break;
+
+      default:
+         ret = -ENOTTY;
+         break;
    }
+
+   latency = ktime_get_ns() - start;
+   latency_hist_record(&ioctl_hist, latency);
+   trace_poll_callback_ioctl(cmd, ret, latency);
+
+   STAT_INC(ioctls);
+   return ret;
+}
+
+/**
+ * @brief function called when the device file is opened
+ */
+static int my_open(struct inode * device_file, struct file * instance)
+{
+   struct poll_client * client = kzalloc(sizeof(*client), GFP_KERNEL);
+
+   if(client == NULL)
+      return -ENOMEM;
+
+   INIT_LIST_HEAD(&client->list);
+   init_waitqueue_head(&client->wait);
+   client->mode = POLL_MODE_SHARED;
+   instance->private_data = client;
+
+   // my_read_iter() honours IOCB_NOWAIT, so io_uring can try reads inline
+   // instead of handing them to a worker thread that would block
+   instance->f_mode |= FMODE_NOWAIT;
    return 0;
 }
 
@@ -49,14 +419,74 @@ static long int my_ioctl(struct file * file, unsigned cmd, unsigned long arg)
  */
 static int my_close(struct inode * device_file, struct file * instance) 
 {
-   printk("poll - close was called!\n");
+   struct poll_client * client = instance->private_data;
+   unsigned long flags;
+
+   trace_poll_callback_release(iminor(device_file));
+
+   // read_lock is needed to take the events left in the queue of the client
+   mutex_lock(&read_lock);
+   spin_lock_irqsave(&post_lock, flags);
+   list_del(&client->list);
+   if(client->mode == POLL_MODE_ROUND_ROBIN)
+      release_assigned(client);
+   spin_unlock_irqrestore(&post_lock, flags);
+   mutex_unlock(&read_lock);
+   kfifo_free(&client->queue);
+   kfree(client);
    return 0;
 }
 
+/**
+ * @brief Add up the per-CPU copies of the counter at the given offset
+ */
+static u64 stats_sum(size_t offset)
+{
+   u64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+      sum += *(u64 *) ((char *) per_cpu_ptr(&stats, cpu) + offset);
+   return sum;
+}
+
+#define STATS_ATTR(field) \
+   static ssize_t field##_show(struct kobject * kobj, struct kobj_attribute * attr, char * buffer) \
+   { \
+      return sprintf(buffer, "%llu\n", stats_sum(offsetof(struct driver_stats, field))); \
+   } \
+   static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+STATS_ATTR(ioctls);
+STATS_ATTR(polls);
+STATS_ATTR(ready);
+STATS_ATTR(wakeups);
+STATS_ATTR(events);
+STATS_ATTR(dropped);
+STATS_ATTR(events_read);
+
+static struct attribute * stats_attrs[] = {
+   &ioctls_attr.attr,
+   &polls_attr.attr,
+   &ready_attr.attr,
+   &wakeups_attr.attr,
+   &events_attr.attr,
+   &dropped_attr.attr,
+   &events_read_attr.attr,
+   NULL
+};
+
+static const struct attribute_group stats_group = {
+   .name = "stats",
+   .attrs = stats_attrs
+};
+
 static struct file_operations fops = {
    .owner = THIS_MODULE,
    .unlocked_ioctl = my_ioctl,    // name of ioctl function
+   .read_iter = my_read_iter,
    .poll = my_poll,
+   .open = my_open,
    .release = my_close
 };
 
@@ -64,6 +494,13 @@ static int __init myInit(void)
 {
    // Init waitqueue
    init_waitqueue_head(&waitqueue);
+   kfifo_init(&events, events_buf, sizeof(events_buf));
+
+   if(latency_hist_init(&ioctl_hist, "poll_callback_ioctl"))
+   {
+      printk("poll - Latency histogram could not be allocated!\n");
+      return -ENOMEM;
+   }
    
    // Register the device number for a new character device
    int retVal = register_chrdev(MY_MAJOR, "LKM_poll", &fops);
@@ -85,16 +522,32 @@ static int __init myInit(void)
    else
    {
       printk("poll - Could not register device number!\n");
+      latency_hist_free(&ioctl_hist);
       return -1;
    }
 
+   // Create /sys/kernel/poll_callback/stats
+   stats_kobj = kobject_create_and_add("poll_callback", kernel_kobj);
+   if(stats_kobj == NULL || sysfs_create_group(stats_kobj, &stats_group))
+   {
+      printk("poll - Error creating the sysfs stats files\n");
+      kobject_put(stats_kobj);
+      unregister_chrdev(MY_MAJOR, "LKM_poll");
+      latency_hist_free(&ioctl_hist);
+      return -ENOMEM;
+   }
+
+   latency_hist_publish(&ioctl_hist);
    return 0;
 }
 
 static void __exit myExit(void)
 {
    printk("poll - exiting!\n");
+   latency_hist_unpublish(&ioctl_hist);
+   kobject_put(stats_kobj);
    unregister_chrdev(MY_MAJOR, "LKM_poll");
+   latency_hist_free(&ioctl_hist);
    return;
 }
 
@@ -0,0 +1,58 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM poll_callback
+
+#if !defined(_POLL_CALLBACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _POLL_CALLBACK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Enable with: echo 1 > /sys/kernel/tracing/events/poll_callback/enable
+
+TRACE_EVENT(poll_callback_release,
+   TP_PROTO(unsigned int minor),
+   TP_ARGS(minor),
+   TP_STRUCT__entry(
+      __field(unsigned int, minor)
+   ),
+   TP_fast_assign(
+      __entry->minor = minor;
+   ),
+   TP_printk("minor=%u", __entry->minor)
+);
+
+TRACE_EVENT(poll_callback_ioctl,
+   TP_PROTO(unsigned int cmd, long ret, u64 latency_ns),
+   TP_ARGS(cmd, ret, latency_ns),
+   TP_STRUCT__entry(
+      __field(unsigned int, cmd)
+      __field(long, ret)
+      __field(u64, latency_ns)
+   ),
+   TP_fast_assign(
+      __entry->cmd = cmd;
+      __entry->ret = ret;
+      __entry->latency_ns = latency_ns;
+   ),
+   TP_printk("cmd=0x%x ret=%ld latency_ns=%llu", __entry->cmd, __entry->ret, __entry->latency_ns)
+);
+
+// The readiness mask returned to every poll/select/epoll call
+TRACE_EVENT(poll_callback_poll,
+   TP_PROTO(unsigned int mask),
+   TP_ARGS(mask),
+   TP_STRUCT__entry(
+      __field(unsigned int, mask)
+   ),
+   TP_fast_assign(
+      __entry->mask = mask;
+   ),
+   TP_printk("mask=0x%x", __entry->mask)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pollCallback_trace
+#include <trace/define_trace.h>
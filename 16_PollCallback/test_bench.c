@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>      // To allow issuing ioctl commands
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "defs.h"
+
+// Results sent by every worker to the parent through a pipe
+struct workerResult
+{
+    uint64_t wakeups;       // Times the wait returned
+    uint64_t empty;         // Wake ups that found nothing to read
+    uint64_t events;        // Events read
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void stopHandler(int sig)
+{
+    stop = 1;
+}
+
+/**
+ * Wait for events and read them until the parent says stop. Mode is "herd"
+ * (plain poll), "excl" (epoll with EPOLLEXCLUSIVE) or "rr" (round-robin)
+ */
+static void worker(const char * mode, int result_fd)
+{
+    struct workerResult result = {0, 0, 0};
+    struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE };
+    struct pollfd pfd;
+    struct pollEvent events[64];
+    int epfd = -1;
+    int ready;
+
+    int fd = open(DEVICE_FILE_NAME, O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
+    {
+        perror("Opening was not possible");
+        exit(1);
+    }
+
+    if (strcmp(mode, "rr") == 0 && ioctl(fd, CMD_SET_MODE, POLL_MODE_ROUND_ROBIN) < 0)
+    {
+        perror("CMD_SET_MODE failed");
+        exit(1);
+    }
+
+    if (strcmp(mode, "excl") == 0)
+    {
+        epfd = epoll_create1(0);
+        event.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!stop)
+    {
+        // Timeout to check the stop flag from time to time
+        if (epfd >= 0)
+            ready = epoll_wait(epfd, &event, 1, 100);
+        else
+            ready = poll(&pfd, 1, 100);
+
+        if (ready <= 0)
+            continue;
+
+        result.wakeups++;
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len > 0)
+            result.events += len / sizeof(events[0]);
+        else
+            result.empty++;
+    }
+
+    write(result_fd, &result, sizeof(result));
+    exit(0);
+}
+
+int main(int argc, char * argv[])
+{
+    const char * mode = argc > 1 ? argv[1] : "herd";
+    int nr_workers = argc > 2 ? atoi(argv[2]) : 4;
+    int nr_events = argc > 3 ? atoi(argv[3]) : 10000;
+    struct workerResult result, total = {0, 0, 0};
+    struct timespec pause = {0, 20000};     // 20 us between events
+    pid_t pids[256];
+    int pipefd[2];
+
+    if (nr_workers < 1 || nr_workers > 256)
+    {
+        printf("Between 1 and 256 workers\n");
+        return -1;
+    }
+
+    signal(SIGUSR1, stopHandler);
+    pipe(pipefd);
+
+    for (int i = 0; i < nr_workers; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            worker(mode, pipefd[1]);
+    }
+
+    // Let the workers start waiting, then post the events one by one
+    sleep(1);
+    int fd = open(DEVICE_FILE_NAME, O_WRONLY);
+    if (fd == -1)
+    {
+        perror("Opening was not possible");
+        return -1;
+    }
+    for (int i = 0; i < nr_events; i++)
+    {
+        ioctl(fd, CMD_UNLOCK, NULL);
+        nanosleep(&pause, NULL);
+    }
+    close(fd);
+
+    // Give the workers time to read the last events, then stop them
+    sleep(1);
+    for (int i = 0; i < nr_workers; i++)
+        kill(pids[i], SIGUSR1);
+
+    printf("mode %s, %d workers, %d events\n", mode, nr_workers, nr_events);
+    for (int i = 0; i < nr_workers; i++)
+    {
+        read(pipefd[0], &result, sizeof(result));
+        printf("  worker: %8llu wake ups, %8llu empty, %8llu events\n",
+               (unsigned long long) result.wakeups, (unsigned long long) result.empty,
+               (unsigned long long) result.events);
+        total.wakeups += result.wakeups;
+        total.empty += result.empty;
+        total.events += result.events;
+    }
+    while (wait(NULL) > 0)
+        ;
+
+    printf("total: %llu events read, %.2f wake ups per event, %llu wasted\n",
+           (unsigned long long) total.events,
+           total.events ? (double) total.wakeups / total.events : 0.0,
+           (unsigned long long) total.empty);
+    return 0;
+}
@@ -12,7 +12,7 @@ int main()
     struct pollfd my_poll;
 
     // Open the device file
-    int fd = open(DEVICE_FILE_NAME, O_RDONLY);
+    int fd = open(DEVICE_FILE_NAME, O_RDONLY | O_NONBLOCK);
     if (fd == -1)
     {
         perror("Opening was not possible\n");
@@ -27,6 +27,20 @@ int main()
     poll(&my_poll,1,-1);
     printf("Unlocked! \n");
 
+    // Take all the queued events. Otherwise the next poll() would return
+    // right away, as the device is readable while there are events
+    struct pollEvent events[64];
+    ssize_t len;
+
+    while ((len = read(fd, events, sizeof(events))) > 0)
+    {
+        for (int i = 0; i < len / (ssize_t) sizeof(events[0]); i++)
+        {
+            printf("Event %u posted by %d at %llu ns\n", events[i].seq, events[i].pid,
+                   (unsigned long long) events[i].timestamp_ns);
+        }
+    }
+
     close(fd);
     return 0;
 }
@@ -6,7 +6,7 @@
 
 #include "defs.h"
 
-int main()
+int main(int argc, char * argv[])
 {
     // Open the device file
     int fd = open(DEVICE_FILE_NAME, O_WRONLY);
@@ -16,15 +16,29 @@ int main()
         return -1;
     }
 
-    // Send the unlocking command to the KM
-    if(ioctl(fd, CMD_UNLOCK, NULL) > 0)
+    // Send the unlocking command to the KM. With an argument, post that
+    // amount of events in a single call instead
+    if(argc > 1)
     {
-        perror("Error unlocking");
-        close(fd);
-        return -1;
+        int posted = ioctl(fd, CMD_POST, atoi(argv[1]));
+        if(posted < 0)
+        {
+            perror("Error posting events");
+            close(fd);
+            return -1;
+        }
+        printf("%d events posted\n", posted);
+    }
+    else
+    {
+        if(ioctl(fd, CMD_UNLOCK, NULL) < 0)
+        {
+            perror("Error unlocking");
+            close(fd);
+            return -1;
+        }
+        printf("Unlock command sent\n");
     }
-
-    printf("Unlock command sent\n");
 
     close(fd);
     return 0;
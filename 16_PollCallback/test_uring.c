@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <liburing.h>
+
+#include "defs.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char * argv[])
+{
+    int reads = argc > 1 ? atoi(argv[1]) : 5;
+    struct pollEvent events[64];
+    struct io_uring ring;
+    struct io_uring_sqe * sqe;
+    struct io_uring_cqe * cqe;
+
+    // Open the device file
+    int fd = open(DEVICE_FILE_NAME, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Opening was not possible");
+        return -1;
+    }
+
+    if (io_uring_queue_init(8, &ring, 0) < 0)
+    {
+        perror("io_uring_queue_init failed");
+        close(fd);
+        return -1;
+    }
+
+    for (int i = 0; i < reads; i++)
+    {
+        // Queue a read. If there are no events, the kernel waits for one
+        // with the poll callback and completes the read by itself
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_read(sqe, fd, events, sizeof(events), 0);
+        io_uring_submit(&ring);
+
+        printf("Read queued, waiting for events...\n");
+        if (io_uring_wait_cqe(&ring, &cqe) < 0)
+        {
+            perror("io_uring_wait_cqe failed");
+            break;
+        }
+
+        if (cqe->res < 0)
+        {
+            printf("Read failed: %d\n", cqe->res);
+        }
+        else
+        {
+            int n = cqe->res / sizeof(events[0]);
+            printf("%d events, the first one posted %llu ns ago\n", n,
+                   (unsigned long long) (now_ns() - events[0].timestamp_ns));
+        }
+        io_uring_cqe_seen(&ring, cqe);
+    }
+
+    io_uring_queue_exit(&ring);
+    close(fd);
+    return 0;
+}
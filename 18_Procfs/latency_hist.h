@@ -0,0 +1,93 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/module.h>
+
+// Bucket i counts the latencies in [2^i, 2^(i+1)) ns. The last one also
+// takes everything above (2^31 ns, about 2 seconds)
+#define LATENCY_BUCKETS 32
+
+struct latency_hist_cpu {
+   u64 buckets[LATENCY_BUCKETS];
+};
+
+/**
+ * Log2 latency histogram. Every CPU counts in its own copy, so recording
+ * a sample is a single non-atomic increment. The copies are only added
+ * up when /proc/hello/latency is read.
+ */
+struct latency_hist {
+   const char * name;
+   struct latency_hist_cpu __percpu * cpu;
+   struct list_head list;        // Entry in the list of /proc/hello/latency
+   bool published;
+};
+
+// Exported by the procfs module (18_Procfs)
+int hello_latency_register(struct latency_hist * hist);
+void hello_latency_unregister(struct latency_hist * hist);
+
+static inline int latency_hist_init(struct latency_hist * hist, const char * name)
+{
+   hist->name = name;
+   hist->published = false;
+   INIT_LIST_HEAD(&hist->list);
+   hist->cpu = alloc_percpu(struct latency_hist_cpu);
+   return hist->cpu ? 0 : -ENOMEM;
+}
+
+static inline void latency_hist_free(struct latency_hist * hist)
+{
+   free_percpu(hist->cpu);
+}
+
+/**
+ * @brief Count one sample of ns nanoseconds
+ */
+static inline void latency_hist_record(struct latency_hist * hist, u64 ns)
+{
+   unsigned int bucket = ns ? min_t(unsigned int, fls64(ns) - 1, LATENCY_BUCKETS - 1) : 0;
+
+   this_cpu_inc(hist->cpu->buckets[bucket]);
+}
+
+/**
+ * @brief Show the histogram in /proc/hello/latency, if the procfs module is
+ * loaded. Modules using histograms don't depend on it: symbol_get() just
+ * fails when it is not there. If it is, it stays pinned until unpublished.
+ */
+static inline void latency_hist_publish(struct latency_hist * hist)
+{
+   int (*do_register)(struct latency_hist *) = symbol_get(hello_latency_register);
+
+   if(do_register == NULL)
+      return;
+
+   if(do_register(hist) == 0)
+      hist->published = true;
+   else
+      symbol_put(hello_latency_register);
+}
+
+static inline void latency_hist_unpublish(struct latency_hist * hist)
+{
+   void (*do_unregister)(struct latency_hist *);
+
+   if(!hist->published)
+      return;
+
+   // The procfs module is pinned by the reference taken in latency_hist_publish,
+   // so this can't fail. Calling it directly would make it a hard dependency
+   do_unregister = symbol_get(hello_latency_unregister);
+   do_unregister(hist);
+   symbol_put(hello_latency_unregister);
+
+   hist->published = false;
+   symbol_put(hello_latency_register);
+}
+
+#endif
@@ -3,35 +3,41 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+
+#include "latency_hist.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Guille");
 MODULE_DESCRIPTION("__");
 
-// Global variables for procfs folder and file
+// Global variables for procfs folder and files
 static struct proc_dir_entry * proc_folder;
 static struct proc_dir_entry * proc_file;
+static struct proc_dir_entry * latency_file;
+static struct proc_dir_entry * latency_cpu_file;
+
+// Histograms shown in /proc/hello/latency, registered by other modules
+static LIST_HEAD(latency_list);
+static DEFINE_MUTEX(latency_lock);
 
 
 /**
- * @brief Read data out of the buffer. In this case, we will return a predefined text
+ * @brief Show the contents of /proc/hello/dummy. seq_file takes care of the
+ * user buffer and the offset, so the text is returned once and then EOF
  */
-static ssize_t driver_read(struct file * File, char * user_buffer, size_t count, loff_t * offset)
+static int dummy_show(struct seq_file * m, void * v)
 {
-   char text[] = "Hello from a procfs file\n";
-   int to_copy, not_copied, delta;
-
-   // 1. Get the amount of data to copy, which will be the minimum
-   // between the amount of bytes requested and the amount of bytes
-   // stored in the buffer (indicated by the pointer value)
-   to_copy = min(count, sizeof(text));
-
-   // 2. Copy the data to the user
-   not_copied = copy_to_user(user_buffer, text, to_copy);
+   seq_puts(m, "Hello from a procfs file\n");
+   return 0;
+}
 
-   // 3. Calculate how much data it has copied
-   delta = to_copy - not_copied;
-   return delta;
+static int dummy_open(struct inode * inode, struct file * file)
+{
+   return single_open(file, dummy_show, NULL);
 }
 
 /**
@@ -40,28 +46,290 @@ static ssize_t driver_read(struct file * File, char * user_buffer, size_t count,
 static ssize_t driver_write(struct file * File, const char * user_buffer, size_t count, loff_t * offset)
 {
    char buffer[256];
-   int to_copy, not_copied, written;
+   int to_copy;
 
    // 1. Get the amount of data to copy, which will be the minimum
-   // between the amount of bytes requested and the size of the buffer
-   to_copy = min(count, sizeof(buffer));
+   // between the amount of bytes requested and the size of the buffer.
+   // One byte is kept for the terminating NUL
+   to_copy = min(count, sizeof(buffer) - 1);
 
-   // 2. Copy the data to the user
-   not_copied = copy_from_user(buffer, user_buffer, to_copy);
+   // 2. Copy the data from the user
+   if(copy_from_user(buffer, user_buffer, to_copy))
+      return -EFAULT;
+   buffer[to_copy] = '\0';
 
    // 3. Print in kernel log:
    printk("procfs - You have writen: %s", buffer);
    
-   // 4. Return how much data has been written
-   written = to_copy - not_copied;
-   return written;
+   // 4. Return how much data has been written. A longer write
+   // will be continued by the user with the rest of the data
+   return to_copy;
 }
 
 static struct proc_ops pops = {
-   .proc_read = driver_read,
+   .proc_open = dummy_open,
+   .proc_read = seq_read,
+   .proc_lseek = seq_lseek,
+   .proc_release = single_release,
    .proc_write = driver_write
 };
 
+/**
+ * @brief Add a histogram to /proc/hello/latency
+ */
+int hello_latency_register(struct latency_hist * hist)
+{
+   mutex_lock(&latency_lock);
+   list_add_tail(&hist->list, &latency_list);
+   mutex_unlock(&latency_lock);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(hello_latency_register);
+
+/**
+ * @brief Remove a histogram from /proc/hello/latency
+ */
+void hello_latency_unregister(struct latency_hist * hist)
+{
+   mutex_lock(&latency_lock);
+   list_del_init(&hist->list);
+   mutex_unlock(&latency_lock);
+}
+EXPORT_SYMBOL_GPL(hello_latency_unregister);
+
+/**
+ * @brief Add the buckets of one CPU to the given array. Returns the amount
+ * of samples of that CPU
+ */
+static u64 latency_add_cpu(struct latency_hist * hist, int cpu, u64 * buckets)
+{
+   struct latency_hist_cpu * c = per_cpu_ptr(hist->cpu, cpu);
+   u64 total = 0;
+   int i;
+
+   for(i = 0; i < LATENCY_BUCKETS; i++)
+   {
+      buckets[i] += c->buckets[i];
+      total += c->buckets[i];
+   }
+   return total;
+}
+
+/**
+ * @brief Add up the per-CPU copies of a histogram. Returns the amount of samples
+ */
+static u64 latency_sum(struct latency_hist * hist, u64 * buckets)
+{
+   u64 total = 0;
+   int cpu;
+
+   memset(buckets, 0, LATENCY_BUCKETS * sizeof(*buckets));
+   for_each_possible_cpu(cpu)
+      total += latency_add_cpu(hist, cpu, buckets);
+   return total;
+}
+
+/**
+ * @brief Upper bound (in ns) of the bucket holding the given percentile,
+ * expressed in per mille (500 -> p50, 999 -> p99.9)
+ */
+static u64 latency_percentile(u64 * buckets, u64 total, unsigned int permille)
+{
+   u64 target, sum = 0;
+   int i;
+
+   if(total == 0)
+      return 0;
+
+   target = div_u64(total * permille + 999, 1000);
+   for(i = 0; i < LATENCY_BUCKETS - 1; i++)
+   {
+      sum += buckets[i];
+      if(sum >= target)
+         break;
+   }
+   return 1ULL << (i + 1);
+}
+
+/**
+ * @brief Print the summary columns shared by both latency files
+ */
+static void latency_print(struct seq_file * m, u64 * buckets, u64 total)
+{
+   seq_printf(m, " %12llu %12llu %12llu %12llu\n", total,
+      latency_percentile(buckets, total, 500),
+      latency_percentile(buckets, total, 990),
+      latency_percentile(buckets, total, 999));
+}
+
+/*
+ * /proc/hello/latency is generated one histogram at a time with a seq_file
+ * iterator: seq_read() calls start/show/next/stop as many times as needed to
+ * fill the user buffer, so the output has no size limit and nothing has to be
+ * copied beforehand. The lock is held from start to stop, which seq_read()
+ * calls before copying each page to the user.
+ */
+static void * latency_start(struct seq_file * m, loff_t * pos)
+{
+   mutex_lock(&latency_lock);
+   return seq_list_start_head(&latency_list, *pos);  // Position 0 is the header
+}
+
+static void * latency_next(struct seq_file * m, void * v, loff_t * pos)
+{
+   return seq_list_next(v, &latency_list, pos);
+}
+
+static void latency_stop(struct seq_file * m, void * v)
+{
+   mutex_unlock(&latency_lock);
+}
+
+/**
+ * @brief Show one record of /proc/hello/latency: a summary line for the
+ * histogram, followed by its non-empty buckets
+ */
+static int latency_show(struct seq_file * m, void * v)
+{
+   struct latency_hist * hist;
+   u64 buckets[LATENCY_BUCKETS];
+   u64 total;
+   int i;
+
+   if(v == &latency_list)
+   {
+      seq_printf(m, "%-24s %12s %12s %12s %12s\n", "name", "samples", "p50(ns)", "p99(ns)", "p999(ns)");
+      return 0;
+   }
+
+   hist = list_entry(v, struct latency_hist, list);
+   total = latency_sum(hist, buckets);
+   seq_printf(m, "%-24s", hist->name);
+   latency_print(m, buckets, total);
+
+   for(i = 0; i < LATENCY_BUCKETS; i++)
+   {
+      if(buckets[i])
+         seq_printf(m, "   < %12llu ns: %llu\n", 1ULL << (i + 1), buckets[i]);
+   }
+   return 0;
+}
+
+static const struct seq_operations latency_sops = {
+   .start = latency_start,
+   .next = latency_next,
+   .stop = latency_stop,
+   .show = latency_show
+};
+
+static int latency_open(struct inode * inode, struct file * file)
+{
+   return seq_open(file, &latency_sops);
+}
+
+/**
+ * @brief Any write to /proc/hello/latency resets all the histograms
+ */
+static ssize_t latency_write(struct file * File, const char * user_buffer, size_t count, loff_t * offset)
+{
+   struct latency_hist * hist;
+   int cpu;
+
+   mutex_lock(&latency_lock);
+   list_for_each_entry(hist, &latency_list, list)
+   {
+      for_each_possible_cpu(cpu)
+         memset(per_cpu_ptr(hist->cpu, cpu), 0, sizeof(struct latency_hist_cpu));
+   }
+   mutex_unlock(&latency_lock);
+
+   return count;
+}
+
+static struct proc_ops latency_pops = {
+   .proc_open = latency_open,
+   .proc_read = seq_read,
+   .proc_lseek = seq_lseek,
+   .proc_release = seq_release,
+   .proc_write = latency_write
+};
+
+/*
+ * /proc/hello/latency_cpu shows the same histograms split by CPU, one record
+ * per possible CPU. The position is the CPU number, and it is also what the
+ * iterator returns, as /proc/interrupts does with the IRQ number.
+ */
+static void * latency_cpu_seek(loff_t * pos)
+{
+   unsigned int cpu;
+
+   if(*pos >= nr_cpu_ids)
+      return NULL;
+
+   // Skip the holes in the CPU numbering
+   cpu = cpumask_next(*pos - 1, cpu_possible_mask);
+   if(cpu >= nr_cpu_ids)
+      return NULL;
+
+   *pos = cpu;
+   return pos;
+}
+
+static void * latency_cpu_start(struct seq_file * m, loff_t * pos)
+{
+   mutex_lock(&latency_lock);
+   return latency_cpu_seek(pos);
+}
+
+static void * latency_cpu_next(struct seq_file * m, void * v, loff_t * pos)
+{
+   (*pos)++;
+   return latency_cpu_seek(pos);
+}
+
+/**
+ * @brief Show one record of /proc/hello/latency_cpu: a line per histogram
+ * with the samples counted by that CPU
+ */
+static int latency_cpu_show(struct seq_file * m, void * v)
+{
+   int cpu = *(loff_t *)v;
+   struct latency_hist * hist;
+   u64 buckets[LATENCY_BUCKETS];
+   u64 total;
+
+   if(cpu == cpumask_first(cpu_possible_mask))
+      seq_printf(m, "%-6s %-24s %12s %12s %12s %12s\n", "cpu", "name", "samples", "p50(ns)", "p99(ns)", "p999(ns)");
+
+   list_for_each_entry(hist, &latency_list, list)
+   {
+      memset(buckets, 0, sizeof(buckets));
+      total = latency_add_cpu(hist, cpu, buckets);
+      seq_printf(m, "%-6d %-24s", cpu, hist->name);
+      latency_print(m, buckets, total);
+   }
+   return 0;
+}
+
+static const struct seq_operations latency_cpu_sops = {
+   .start = latency_cpu_start,
+   .next = latency_cpu_next,
+   .stop = latency_stop,
+   .show = latency_cpu_show
+};
+
+static int latency_cpu_open(struct inode * inode, struct file * file)
+{
+   return seq_open(file, &latency_cpu_sops);
+}
+
+static struct proc_ops latency_cpu_pops = {
+   .proc_open = latency_cpu_open,
+   .proc_read = seq_read,
+   .proc_lseek = seq_lseek,
+   .proc_release = seq_release
+};
+
 /**
  * @brief function called when the module is loaded into the kernel
  */
@@ -86,6 +354,27 @@ static int __init myInit(void)
       return -ENOMEM;
    }
 
+   // This will create the file "latency" in /proc/hello/
+   latency_file = proc_create("latency", 0644, proc_folder, &latency_pops);
+   if(latency_file == NULL)
+   {
+      printk("procfs - Error creating 'latency' file\n");
+      proc_remove(proc_file);
+      proc_remove(proc_folder);
+      return -ENOMEM;
+   }
+
+   // This will create the file "latency_cpu" in /proc/hello/
+   latency_cpu_file = proc_create("latency_cpu", 0444, proc_folder, &latency_cpu_pops);
+   if(latency_cpu_file == NULL)
+   {
+      printk("procfs - Error creating 'latency_cpu' file\n");
+      proc_remove(latency_file);
+      proc_remove(proc_file);
+      proc_remove(proc_folder);
+      return -ENOMEM;
+   }
+
    printk("procfs - Created '/proc/hello/dummy' file successfully\n");
 
    return 0;
@@ -97,6 +386,8 @@ static int __init myInit(void)
 static void __exit myExit(void)
 {
    printk("procfs - Bye bye!\n");
+   proc_remove(latency_cpu_file);
+   proc_remove(latency_file);
    proc_remove(proc_file);
    proc_remove(proc_folder);
    return;